@@ -1,12 +1,27 @@
 #include "expression.h"
 
-#include <ctype.h> /* for isspace */
 #include <limits.h>
+#include <locale.h> /* for localeconv */
 #include <math.h> /* for pow */
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#include <sys/mman.h> /* for mmap */
+#define EXPR_JIT 1
+#endif
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(EXPR_NO_SIMD)
+#include <immintrin.h> /* for batch kernels */
+#endif
+#if (defined(__unix__) || defined(__APPLE__)) && defined(__GNUC__)           \
+    && !defined(EXPR_NO_THREADS)
+#include <pthread.h> /* for the worker pool */
+#include <unistd.h>  /* for sysconf */
+#define EXPR_THREADS 1
+#endif
+
 /*
  * Expression data types
  */
@@ -48,10 +63,27 @@ enum expr_type {
     OP_CONST,
     OP_VAR,
     OP_FUNC,
+    OP_CALL, /* call of a $() function */
+    OP_ARG,  /* argument of the enclosing $() function */
+
+    /* Built-in functions, in the order of expr_builtins[] */
+    OP_SQRT,
+    OP_ABS,
+    OP_FLOOR,
+    OP_CEIL,
+    OP_EXP,
+    OP_LOG,
+    OP_SIN,
+    OP_COS,
+    OP_MIN,
+    OP_MAX,
+    OP_CLAMP,
+    OP_FMA,
+    OP_SELECT,
 };
 
 static int prec[] = { 0, 1, 1, 1, 2, 2, 2, 2, 3, 3, 4, 4, 5, 5, 5, 5, 5, 5, 6,
-    7, 8, 9, 10, 11, 12, 0, 0, 0 };
+    7, 8, 9, 10, 11, 12, 0, 0, 0, 0, 0 };
 
 #define expr_init()                                                           \
     {                                                                         \
@@ -69,10 +101,16 @@ static int expr_is_unary(enum expr_type op)
         || op == OP_UNARY_BITWISE_NOT;
 }
 
+static int expr_is_builtin(enum expr_type op)
+{
+    return op >= OP_SQRT && op <= OP_SELECT;
+}
+
 static int expr_is_binary(enum expr_type op)
 {
     return !expr_is_unary(op) && op != OP_CONST && op != OP_VAR
-        && op != OP_FUNC && op != OP_UNKNOWN;
+        && op != OP_FUNC && op != OP_CALL && op != OP_ARG
+        && op != OP_UNKNOWN && !expr_is_builtin(op);
 }
 
 static int expr_prec(enum expr_type a, enum expr_type b)
@@ -82,67 +120,270 @@ static int expr_prec(enum expr_type a, enum expr_type b)
     return (left && prec[a] >= prec[b]) || (prec[a] > prec[b]);
 }
 
-#define isfirstvarchr(c)                                                      \
-    (((unsigned char)c >= '@' && c != '^' && c != '|') || c == '$')
-#define isvarchr(c)                                                           \
-    (((unsigned char)c >= '@' && c != '^' && c != '|') || c == '$'            \
-        || c == '#' || (c >= '0' && c <= '9'))
-
-static struct {
-    const char *s;
-    const enum expr_type op;
-} OPS[] = {
-    { "-u", OP_UNARY_MINUS }, { "!u", OP_UNARY_LOGICAL_NOT },
-    { "^u", OP_UNARY_BITWISE_NOT }, { "**", OP_POWER }, { "*", OP_MULTIPLY },
-    { "/", OP_DIVIDE }, { "%", OP_REMAINDER }, { "+", OP_PLUS },
-    { "-", OP_MINUS }, { "<<", OP_SHL }, { ">>", OP_SHR }, { "<", OP_LT },
-    { "<=", OP_LE }, { ">", OP_GT }, { ">=", OP_GE }, { "==", OP_EQ },
-    { "!=", OP_NE }, { "&", OP_BITWISE_AND }, { "|", OP_BITWISE_OR },
-    { "^", OP_BITWISE_XOR }, { "&&", OP_LOGICAL_AND }, { "||", OP_LOGICAL_OR },
-    { "=", OP_ASSIGN }, { ",", OP_COMMA },
-
-    /* These are used by lexer and must be ignored by parser, so we put
-       them at the end */
-    { "-", OP_UNARY_MINUS }, { "!", OP_UNARY_LOGICAL_NOT },
-    { "^", OP_UNARY_BITWISE_NOT },
+/* Character classes, one table lookup instead of the ctype calls */
+#define EXPR_CC_SPACE (1 << 0)
+#define EXPR_CC_DIGIT (1 << 1)
+#define EXPR_CC_FIRSTVAR (1 << 2)
+#define EXPR_CC_VAR (1 << 3)
+
+#define EXPR_CC_ISDIGIT(c) ((c) >= '0' && (c) <= '9')
+#define EXPR_CC_ISFIRSTVAR(c)                                                 \
+    (((c) >= '@' && (c) != '^' && (c) != '|') || (c) == '$')
+#define EXPR_CC(c)                                                            \
+    (((c) == ' ' || ((c) >= '\t' && (c) <= '\r') ? EXPR_CC_SPACE : 0)         \
+        | (EXPR_CC_ISDIGIT(c) ? EXPR_CC_DIGIT : 0)                            \
+        | (EXPR_CC_ISFIRSTVAR(c) ? EXPR_CC_FIRSTVAR : 0)                      \
+        | (EXPR_CC_ISFIRSTVAR(c) || EXPR_CC_ISDIGIT(c) || (c) == '#'          \
+                ? EXPR_CC_VAR                                                 \
+                : 0))
+#define EXPR_CC4(c) EXPR_CC(c), EXPR_CC(c + 1), EXPR_CC(c + 2), EXPR_CC(c + 3)
+#define EXPR_CC16(c)                                                          \
+    EXPR_CC4(c), EXPR_CC4(c + 4), EXPR_CC4(c + 8), EXPR_CC4(c + 12)
+#define EXPR_CC64(c)                                                          \
+    EXPR_CC16(c), EXPR_CC16(c + 16), EXPR_CC16(c + 32), EXPR_CC16(c + 48)
+
+static const unsigned char expr_cc[256] = {
+    EXPR_CC64(0), EXPR_CC64(64), EXPR_CC64(128), EXPR_CC64(192),
 };
 
+#define expr_cc_is(c, cc) (expr_cc[(unsigned char)(c)] & (cc))
+#define isfirstvarchr(c) expr_cc_is(c, EXPR_CC_FIRSTVAR)
+#define isvarchr(c) expr_cc_is(c, EXPR_CC_VAR)
+#define expr_isspace(c) expr_cc_is(c, EXPR_CC_SPACE)
+#define expr_isdigit(c) expr_cc_is(c, EXPR_CC_DIGIT)
+
+/* Operators are one or two characters long, both are packed into a single
+ * switch key. The lexer spells unary operators "-", "!" and "^", which are
+ * unary when unary is 1, the parser spells them "-u", "!u" and "^u". */
+#define EXPR_OP2(a, b) (0x10000 | ((a) << 8) | (b))
+
 static enum expr_type expr_op(const char *s, size_t len, int unary)
 {
-    for (unsigned int i = 0; i < sizeof(OPS) / sizeof(OPS[0]); i++) {
-        if (strlen(OPS[i].s) == len && strncmp(OPS[i].s, s, len) == 0
-            && (unary == -1 || expr_is_unary(OPS[i].op) == unary)) {
-            return OPS[i].op;
+    enum expr_type op = OP_UNKNOWN;
+    int key = 0;
+    if (len == 1) {
+        key = (unsigned char)s[0];
+    } else if (len == 2) {
+        key = EXPR_OP2((unsigned char)s[0], (unsigned char)s[1]);
+    }
+    switch (key) {
+    case '*':
+        op = OP_MULTIPLY;
+        break;
+    case '/':
+        op = OP_DIVIDE;
+        break;
+    case '%':
+        op = OP_REMAINDER;
+        break;
+    case '+':
+        op = OP_PLUS;
+        break;
+    case '-':
+        op = (unary == 1 ? OP_UNARY_MINUS : OP_MINUS);
+        break;
+    case '<':
+        op = OP_LT;
+        break;
+    case '>':
+        op = OP_GT;
+        break;
+    case '&':
+        op = OP_BITWISE_AND;
+        break;
+    case '|':
+        op = OP_BITWISE_OR;
+        break;
+    case '^':
+        op = (unary == 1 ? OP_UNARY_BITWISE_NOT : OP_BITWISE_XOR);
+        break;
+    case '!':
+        op = OP_UNARY_LOGICAL_NOT;
+        break;
+    case '=':
+        op = OP_ASSIGN;
+        break;
+    case ',':
+        op = OP_COMMA;
+        break;
+    case EXPR_OP2('-', 'u'):
+        op = OP_UNARY_MINUS;
+        break;
+    case EXPR_OP2('!', 'u'):
+        op = OP_UNARY_LOGICAL_NOT;
+        break;
+    case EXPR_OP2('^', 'u'):
+        op = OP_UNARY_BITWISE_NOT;
+        break;
+    case EXPR_OP2('*', '*'):
+        op = OP_POWER;
+        break;
+    case EXPR_OP2('<', '<'):
+        op = OP_SHL;
+        break;
+    case EXPR_OP2('>', '>'):
+        op = OP_SHR;
+        break;
+    case EXPR_OP2('<', '='):
+        op = OP_LE;
+        break;
+    case EXPR_OP2('>', '='):
+        op = OP_GE;
+        break;
+    case EXPR_OP2('=', '='):
+        op = OP_EQ;
+        break;
+    case EXPR_OP2('!', '='):
+        op = OP_NE;
+        break;
+    case EXPR_OP2('&', '&'):
+        op = OP_LOGICAL_AND;
+        break;
+    case EXPR_OP2('|', '|'):
+        op = OP_LOGICAL_OR;
+        break;
+    }
+    if (op != OP_UNKNOWN && unary != -1 && expr_is_unary(op) != unary) {
+        return OP_UNKNOWN;
+    }
+    return op;
+}
+
+/* Built-in functions. User functions of the same name take precedence. */
+static const struct expr_builtin {
+    const char *name;
+    enum expr_type op;
+    int nargs;
+} expr_builtins[] = {
+    { "sqrt", OP_SQRT, 1 },
+    { "abs", OP_ABS, 1 },
+    { "floor", OP_FLOOR, 1 },
+    { "ceil", OP_CEIL, 1 },
+    { "exp", OP_EXP, 1 },
+    { "log", OP_LOG, 1 },
+    { "sin", OP_SIN, 1 },
+    { "cos", OP_COS, 1 },
+    { "min", OP_MIN, 2 },
+    { "max", OP_MAX, 2 },
+    { "clamp", OP_CLAMP, 3 },
+    { "fma", OP_FMA, 3 },
+    { "select", OP_SELECT, 3 },
+    { NULL, OP_UNKNOWN, 0 },
+};
+
+static const struct expr_builtin *expr_builtin(const char *s, size_t len)
+{
+    for (const struct expr_builtin *b = expr_builtins; b->name; b++) {
+        if (strncmp(b->name, s, len) == 0 && b->name[len] == '\0') {
+            return b;
         }
     }
-    return OP_UNKNOWN;
+    return NULL;
+}
+
+/* Literals the fast path can't round correctly go through strtof(), with
+ * the decimal point of the current locale */
+static float expr_parse_number_slow(const char *s, size_t len)
+{
+    char buf[64];
+    char *p = (len < sizeof(buf) ? buf : malloc(len + 1));
+    if (p == NULL) {
+        return NAN;
+    }
+    char point = *localeconv()->decimal_point;
+    for (size_t i = 0; i < len; i++) {
+        p[i] = (s[i] == '.' ? point : s[i]);
+    }
+    p[len] = '\0';
+    char *end;
+    float num = strtof(p, &end);
+    if (end != p + len) {
+        num = NAN;
+    }
+    if (p != buf) {
+        free(p);
+    }
+    return num;
 }
 
+/* Decimal literals with up to 15 or so significant digits and a small
+ * exponent are computed exactly in double. Rounding that to float is only
+ * wrong when the double lands on a midpoint between two floats, those take
+ * the slow path too. */
 static float expr_parse_number(const char *s, size_t len)
 {
-    float num = 0;
-    unsigned int frac = 0;
-    unsigned int digits = 0;
-    for (unsigned int i = 0; i < len; i++) {
-        if (s[i] == '.' && frac == 0) {
-            frac++;
+    static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+        1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+        1e20, 1e21, 1e22 };
+    if (len > 1 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        return expr_parse_number_slow(s, len);
+    }
+    uint64_t w = 0;
+    int digits = 0, dot = 0, exact = 1;
+    long e10 = 0;
+    size_t i = 0;
+    for (; i < len; i++) {
+        if (s[i] == '.' && !dot) {
+            dot = 1;
             continue;
         }
-        if (isdigit(s[i])) {
-            digits++;
-            if (frac > 0) {
-                frac++;
-            }
-            num = num * 10 + (s[i] - '0');
+        if (!expr_isdigit(s[i])) {
+            break;
+        }
+        digits++;
+        if (w < (UINT64_MAX - 9) / 10) {
+            w = w * 10 + (s[i] - '0');
+            e10 -= dot;
         } else {
+            exact = exact && s[i] == '0';
+            e10 += !dot;
+        }
+    }
+    if (digits == 0) {
+        return NAN;
+    }
+    if (i < len) {
+        if (s[i] != 'e' && s[i] != 'E') {
+            return NAN;
+        }
+        int neg = 0;
+        long e = 0;
+        if (++i < len && (s[i] == '-' || s[i] == '+')) {
+            neg = (s[i++] == '-');
+        }
+        if (i == len) {
             return NAN;
         }
+        for (; i < len; i++) {
+            if (!expr_isdigit(s[i])) {
+                return NAN;
+            }
+            e = (e < 100000 ? e * 10 + (s[i] - '0') : e);
+        }
+        e10 += (neg ? -e : e);
+    }
+    if (w == 0) {
+        return 0;
+    }
+    if (exact && w < (1ull << 53) && e10 >= -22 && e10 <= 22) {
+        double d = (e10 < 0 ? (double)w / pow10[-e10] : (double)w * pow10[e10]);
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        /* A double carries 29 more mantissa bits than a float */
+        if ((bits & 0x1fffffff) != 0x10000000) {
+            return (float)d;
+        }
     }
-    while (frac > 1) {
-        num = num / 10;
-        frac--;
+    return expr_parse_number_slow(s, len);
+}
+
+static unsigned int expr_hash(const char *s, size_t len)
+{
+    unsigned int h = 2166136261u; /* FNV-1a */
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
     }
-    return (digits > 0 ? num : NAN);
+    return h;
 }
 
 /*
@@ -151,18 +392,120 @@ static float expr_parse_number(const char *s, size_t len)
 struct expr_func *expr_func(
     struct expr_func *funcs, const char *s, size_t len)
 {
-    for (struct expr_func *f = funcs; f->name; f++) {
-        if (strlen(f->name) == len && strncmp(f->name, s, len) == 0) {
+    for (struct expr_func *f = funcs; f && f->name; f++) {
+        if (strncmp(f->name, s, len) == 0 && f->name[len] == '\0') {
             return f;
         }
     }
     return NULL;
 }
 
+/* Open addressing table over a function array, names are hashed once */
+struct expr_func_entry {
+    struct expr_func *f;
+    size_t len;
+    unsigned int hash;
+};
+
+struct expr_func_registry {
+    struct expr_func_entry *table;
+    unsigned int cap;
+};
+
+struct expr_func_registry *expr_func_registry_create(struct expr_func *funcs)
+{
+    unsigned int n = 0, cap = 16;
+    for (struct expr_func *f = funcs; f && f->name; f++) {
+        n++;
+    }
+    while (n * 2 > cap) {
+        cap = cap * 2;
+    }
+    struct expr_func_registry *r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+        return NULL;
+    }
+    r->cap = cap;
+    if ((r->table = calloc(cap, sizeof(struct expr_func_entry))) == NULL) {
+        free(r);
+        return NULL;
+    }
+    for (struct expr_func *f = funcs; f && f->name; f++) {
+        size_t len = strlen(f->name);
+        if (expr_func_registry_find(r, f->name, len)) {
+            continue; /* the first definition wins, as in expr_func() */
+        }
+        unsigned int hash = expr_hash(f->name, len);
+        unsigned int i = hash & (cap - 1);
+        while (r->table[i].f) {
+            i = (i + 1) & (cap - 1);
+        }
+        r->table[i].f = f;
+        r->table[i].len = len;
+        r->table[i].hash = hash;
+    }
+    return r;
+}
+
+struct expr_func *expr_func_registry_find(
+    struct expr_func_registry *r, const char *s, size_t len)
+{
+    unsigned int hash = expr_hash(s, len);
+    for (unsigned int i = hash & (r->cap - 1); r->table[i].f;
+         i = (i + 1) & (r->cap - 1)) {
+        struct expr_func_entry *e = &r->table[i];
+        if (e->hash == hash && e->len == len
+            && memcmp(e->f->name, s, len) == 0) {
+            return e->f;
+        }
+    }
+    return NULL;
+}
+
+void expr_func_registry_destroy(struct expr_func_registry *r)
+{
+    if (r) {
+        free(r->table);
+        free(r);
+    }
+}
+
 /*
  * Variables
  */
 
+/* Variables are kept in the list and indexed by an open addressing table
+ * with linear probing, rebuilt from the list at 3/4 load */
+static void expr_var_insert(struct expr_var_list *vars, struct expr_var *v)
+{
+    unsigned int i = v->hash & (vars->cap - 1);
+    while (vars->table[i]) {
+        i = (i + 1) & (vars->cap - 1);
+    }
+    vars->table[i] = v;
+    vars->len++;
+}
+
+static int expr_var_rehash(struct expr_var_list *vars, unsigned int n)
+{
+    unsigned int cap = vars->cap ? vars->cap : 16;
+    while (n * 4 > cap * 3) {
+        cap = cap * 2;
+    }
+    struct expr_var **table = calloc(cap, sizeof(struct expr_var *));
+    if (table == NULL) {
+        return -1;
+    }
+    free(vars->table);
+    vars->table = table;
+    vars->cap = cap;
+    vars->len = 0;
+    for (struct expr_var *v = vars->head; v; v = v->next) {
+        expr_var_insert(vars, v);
+    }
+    return 0;
+}
+
 struct expr_var *expr_var(
     struct expr_var_list *vars, const char *s, size_t len)
 {
@@ -170,21 +513,51 @@ struct expr_var *expr_var(
     if (len == 0 || !isfirstvarchr(*s)) {
         return NULL;
     }
-    for (v = vars->head; v; v = v->next) {
-        if (strlen(v->name) == len && strncmp(v->name, s, len) == 0) {
-            return v;
+    if (vars->table == NULL && vars->head) {
+        /* The list was filled by hand, index it first */
+        unsigned int n = 0;
+        for (v = vars->head; v; v = v->next, n++) {
+            v->index = n;
+            v->len = strlen(v->name);
+            v->hash = expr_hash(v->name, v->len);
+        }
+        if (expr_var_rehash(vars, n) == -1) {
+            return NULL;
+        }
+    }
+    unsigned int hash = expr_hash(s, len);
+    if (vars->table) {
+        for (unsigned int i = hash & (vars->cap - 1); (v = vars->table[i]);
+             i = (i + 1) & (vars->cap - 1)) {
+            if (v->hash == hash && v->len == len
+                && memcmp(v->name, s, len) == 0) {
+                return v;
+            }
         }
     }
+    if ((vars->len + 1) * 4 > vars->cap * 3
+        && expr_var_rehash(vars, vars->len + 1) == -1) {
+        return NULL;
+    }
     v = (struct expr_var *)calloc(1, sizeof(struct expr_var) + len + 1);
     if (!v) return NULL; /* allocation failed */
     v->next = vars->head;
     v->value = 0;
-    strncpy(v->name, s, len);
+    v->hash = hash;
+    v->len = len;
+    v->index = vars->len;
+    memcpy(v->name, s, len);
     v->name[len] = '\0';
     vars->head = v;
+    expr_var_insert(vars, v);
     return v;
 }
 
+struct expr_var *expr_var_next(struct expr_var_list *vars, struct expr_var *v)
+{
+    return v ? v->next : vars->head;
+}
+
 static int to_int(float x)
 {
     if (isnan(x)) {
@@ -195,130 +568,361 @@ static int to_int(float x)
     return (int)x;
 }
 
+/* min() and max() ignore a NaN operand, like fminf() and fmaxf(), and order
+ * -0 before +0, so that every evaluator gets the same bits */
+static float expr_min(float a, float b)
+{
+    if (isnan(b) || a < b) {
+        return a;
+    } else if (a == b && signbit(a)) {
+        return a;
+    }
+    return b;
+}
 
-float expr_eval_with_dfs(struct expr *e)
+static float expr_max(float a, float b)
 {
-#define STACK_SIZE 1000
-    int visited[STACK_SIZE] = {0};
-    struct expr *op_stack[STACK_SIZE];
-    float tmp_val[STACK_SIZE];
+    if (isnan(b) || a > b) {
+        return a;
+    } else if (a == b && !signbit(a)) {
+        return a;
+    }
+    return b;
+}
 
-    int op_sp = -1;
-    int tmp_sp = -1;
+static float expr_select(float c, float a, float b)
+{
+    return c != 0 ? a : b;
+}
 
-    struct expr *current;
+/*
+ * User-defined functions. The body of $(name, ...) is parsed once and shared
+ * by all call sites, with $1, $2... turned into OP_ARG nodes. A call pushes a
+ * frame with the values of its arguments, missing ones being zero, and the
+ * arguments read and assign that frame.
+ */
+struct expr_macro {
+    int refs; /* call sites and the parser, unused in arenas */
+    int nparams;
+    struct expr body;
+};
 
-    op_stack[++op_sp] = e;
+#if defined(__GNUC__)
+#define EXPR_TLS __thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define EXPR_TLS _Thread_local
+#else
+#define EXPR_TLS
+#endif
 
-    while (op_sp >= 0) {
-        current = op_stack[op_sp];
+/* Frame of the innermost call being evaluated on this thread */
+static EXPR_TLS float *expr_frame;
 
-        if (visited[op_sp]) {
+static float expr_call(struct expr *e)
+{
+    struct expr_macro *m = e->param.call.macro;
+    vec_expr_t *args = &e->param.call.args;
+    float frame[m->nparams > 0 ? m->nparams : 1];
+    for (int i = 0; i < vec_len(args) || i < m->nparams; i++) {
+        float v = (i < vec_len(args) ? expr_eval(&vec_nth(args, i)) : 0);
+        if (i < m->nparams) {
+            frame[i] = v;
+        }
+    }
+    float *caller = expr_frame;
+    expr_frame = frame;
+    float n = expr_eval(&m->body);
+    expr_frame = caller;
+    return n;
+}
 
-            float val;
+/* Lazy functions evaluate their arguments themselves, native ones are given
+ * the values */
+static float expr_func_eval(struct expr *e)
+{
+    struct expr_func *f = e->param.func.f;
+    if (f->f) {
+        return f->f(f, e->param.func.args, e->param.func.context);
+    }
+    int n = vec_len(&e->param.func.args);
+    float args[n > 0 ? n : 1];
+    for (int k = 0; k < n; k++) {
+        args[k] = expr_eval(&vec_nth(&e->param.func.args, k));
+    }
+    return f->native(f, args, n, e->param.func.context);
+}
 
-            switch (current->type) {
-                case OP_UNARY_MINUS:
-                    val = -tmp_val[tmp_sp--];
-                    break;
-                case OP_UNARY_LOGICAL_NOT:
-                    val = !tmp_val[tmp_sp--];
-                    break;
-                case OP_UNARY_BITWISE_NOT:
-                    val = ~to_int(tmp_val[tmp_sp--]);
-                    break;
-                case OP_POWER:
-                    val = powf(tmp_val[tmp_sp--], tmp_val[tmp_sp--]);
-                    break;
-                case OP_MULTIPLY:
-                    val = tmp_val[tmp_sp--] * tmp_val[tmp_sp--];
-                    break;
-                case OP_DIVIDE:
-                    val = tmp_val[tmp_sp--] / tmp_val[tmp_sp--];
-                    break;
-                case OP_REMAINDER:
-                    val = fmodf(tmp_val[tmp_sp--], tmp_val[tmp_sp--]);
-                    break;
-                case OP_PLUS:
-                    val = tmp_val[tmp_sp--] + tmp_val[tmp_sp--];
-                    break;
-                case OP_MINUS:
-                    val = tmp_val[tmp_sp--] - tmp_val[tmp_sp--];
-                    break;
-                case OP_SHL:
-                    val = to_int(tmp_val[tmp_sp--]) << to_int(tmp_val[tmp_sp--]);
-                    break;
-                case OP_SHR:
-                    val = to_int(tmp_val[tmp_sp--]) >> to_int(tmp_val[tmp_sp--]);
-                    break;
-                case OP_LT:
-                    val = tmp_val[tmp_sp--] < tmp_val[tmp_sp--];
-                    break;
-                case OP_LE:
-                    val = tmp_val[tmp_sp--] <= tmp_val[tmp_sp--];
-                    break;
-                    val = tmp_val[tmp_sp--] > tmp_val[tmp_sp--];
-                    break;
-                case OP_GE:
-                    val = tmp_val[tmp_sp--] >= tmp_val[tmp_sp--];
-                    break;
-                case OP_EQ:
-                    val = tmp_val[tmp_sp--] == tmp_val[tmp_sp--];
-                    break;
-                case OP_NE:
-                    val = tmp_val[tmp_sp--] != tmp_val[tmp_sp--];
-                    break;
-                case OP_BITWISE_AND:
-                    val = to_int(tmp_val[tmp_sp--]) & to_int(tmp_val[tmp_sp--]);
-                    break;
-                case OP_BITWISE_OR:
-                    val = to_int(tmp_val[tmp_sp--]) | to_int(tmp_val[tmp_sp--]);
-                    break;
-                case OP_BITWISE_XOR:
-                    val = to_int(tmp_val[tmp_sp--]) ^ to_int(tmp_val[tmp_sp--]);
-                    break;
-                case OP_LOGICAL_AND:
-                    val = tmp_val[tmp_sp--];
-                    if (val != 0) {
-                        val = tmp_val[tmp_sp--];
-                    }
-                    else {
-                        tmp_sp--;
-                    }
-                    break;
-                case OP_LOGICAL_OR:
-                    val = tmp_val[tmp_sp--];
-                    if (val == 0) {
-                        val = tmp_val[tmp_sp--];
-                    }
-                    else {
-                        tmp_sp--;
-                    }
-                    break;
-                case OP_COMMA:
-                    tmp_sp--;
-                    val = tmp_val[tmp_sp--];
-                    break;
-                default:
-                    return NAN;
-            }
 
-            tmp_val[++tmp_sp] = val;
-            op_sp--;
-        }
-        else if (current->type == OP_VAR || current->type == OP_CONST) {
-            op_sp--;
-            tmp_val[++tmp_sp] = current->type == OP_VAR ? *current->param.var.value : current->param.num.value;
-        }
-        else {
-            visited[op_sp] = 1;
-            for (int i = 0; i < current->param.op.args.len; i++) {
-                op_stack[++op_sp] = &current->param.op.args.buf[i];
+/* Strict operators and built-ins, applied to the values of their operands */
+static float expr_apply(int op, const float *v)
+{
+    switch (op) {
+    case OP_UNARY_MINUS:
+        return -(v[0]);
+    case OP_UNARY_LOGICAL_NOT:
+        return !(v[0]);
+    case OP_UNARY_BITWISE_NOT:
+        return ~(to_int(v[0]));
+    case OP_POWER:
+        return powf(v[0], v[1]);
+    case OP_MULTIPLY:
+        return v[0] * v[1];
+    case OP_DIVIDE:
+        return v[0] / v[1];
+    case OP_REMAINDER:
+        return fmodf(v[0], v[1]);
+    case OP_PLUS:
+        return v[0] + v[1];
+    case OP_MINUS:
+        return v[0] - v[1];
+    case OP_SHL:
+        return to_int(v[0]) << to_int(v[1]);
+    case OP_SHR:
+        return to_int(v[0]) >> to_int(v[1]);
+    case OP_LT:
+        return v[0] < v[1];
+    case OP_LE:
+        return v[0] <= v[1];
+    case OP_GT:
+        return v[0] > v[1];
+    case OP_GE:
+        return v[0] >= v[1];
+    case OP_EQ:
+        return v[0] == v[1];
+    case OP_NE:
+        return v[0] != v[1];
+    case OP_BITWISE_AND:
+        return to_int(v[0]) & to_int(v[1]);
+    case OP_BITWISE_OR:
+        return to_int(v[0]) | to_int(v[1]);
+    case OP_BITWISE_XOR:
+        return to_int(v[0]) ^ to_int(v[1]);
+    case OP_COMMA:
+        return v[1];
+    case OP_SQRT:
+        return sqrtf(v[0]);
+    case OP_ABS:
+        return fabsf(v[0]);
+    case OP_FLOOR:
+        return floorf(v[0]);
+    case OP_CEIL:
+        return ceilf(v[0]);
+    case OP_EXP:
+        return expf(v[0]);
+    case OP_LOG:
+        return logf(v[0]);
+    case OP_SIN:
+        return sinf(v[0]);
+    case OP_COS:
+        return cosf(v[0]);
+    case OP_MIN:
+        return expr_min(v[0], v[1]);
+    case OP_MAX:
+        return expr_max(v[0], v[1]);
+    case OP_CLAMP:
+        return expr_min(expr_max(v[0], v[1]), v[2]);
+    case OP_FMA:
+        return fmaf(v[0], v[1], v[2]);
+    case OP_SELECT:
+        return expr_select(v[0], v[1], v[2]);
+    default:
+        return NAN;
+    }
+}
+
+/*
+ * Iterative evaluation. Nodes wait on an explicit stack while their operands
+ * are computed one after the other, and values are kept on a second stack,
+ * so the depth of the expression doesn't matter. Both stacks start on the C
+ * stack and move to the heap when they outgrow it. The frame of a call is
+ * the values of its arguments, right on the value stack.
+ */
+#define EXPR_STACK 64
+
+struct expr_dfs_node {
+    struct expr *e;
+    int state;  /* operands computed so far */
+    int base;   /* frame of a call, as an index of values */
+    int caller; /* frame of the caller, -1 outside of calls */
+};
+
+struct expr_dfs {
+    struct expr_dfs_node *nodes;
+    int nnodes, nodecap;
+    float *values;
+    int nvalues, valuecap;
+    int frame;   /* frame of the innermost call, or -1 */
+    float *outer; /* frame of the caller of expr_eval_with_dfs() */
+};
+
+static int expr_stack_grow(void **buf, int *cap, void *local, size_t size)
+{
+    void *p = malloc(*cap * 2 * size);
+    if (p == NULL) {
+        return -1;
+    }
+    memcpy(p, *buf, *cap * size);
+    if (*buf != local) {
+        free(*buf);
+    }
+    *buf = p;
+    *cap *= 2;
+    return 0;
+}
+
+float expr_eval_with_dfs(struct expr *e)
+{
+    struct expr_dfs_node nodes[EXPR_STACK];
+    float values[EXPR_STACK];
+    struct expr_dfs s = { nodes, 0, EXPR_STACK, values, 0,
+        EXPR_STACK, -1, expr_frame };
+    float n, result = NAN;
+
+#define DFS_PUSH(x)                                                           \
+    do {                                                                      \
+        struct expr *next = (x); /* before d moves along with the stack */    \
+        if (s.nnodes == s.nodecap &&                                          \
+            expr_stack_grow((void **)&s.nodes, &s.nodecap, nodes,             \
+                sizeof(*s.nodes)) < 0) {                                      \
+            goto cleanup;                                                     \
+        }                                                                     \
+        s.nodes[s.nnodes].e = next;                                           \
+        s.nodes[s.nnodes++].state = 0;                                        \
+    } while (0)
+#define DFS_VALUE(v)                                                          \
+    do {                                                                      \
+        if (s.nvalues == s.valuecap) {                                        \
+            if (expr_stack_grow((void **)&s.values, &s.valuecap, values,      \
+                    sizeof(*s.values)) < 0) {                                 \
+                goto cleanup;                                                 \
+            }                                                                 \
+            if (s.frame >= 0) {                                               \
+                expr_frame = &s.values[s.frame];                              \
+            }                                                                 \
+        }                                                                     \
+        s.values[s.nvalues++] = (v);                                          \
+    } while (0)
+
+    DFS_PUSH(e);
+    while (s.nnodes > 0) {
+        struct expr_dfs_node *d = &s.nodes[s.nnodes - 1];
+        struct expr *x = d->e;
+        vec_expr_t *args = &x->param.op.args;
+        switch (x->type) {
+        case OP_CONST:
+            n = x->param.num.value;
+            break;
+        case OP_VAR:
+            n = *x->param.var.value;
+            break;
+        case OP_ARG:
+            n = expr_frame[x->param.arg.index];
+            break;
+        case OP_ASSIGN:
+            if (d->state++ == 0) {
+                DFS_PUSH(&vec_nth(args, 1));
+                continue;
+            }
+            n = s.values[--s.nvalues];
+            if (vec_nth(args, 0).type == OP_VAR) {
+                *vec_nth(args, 0).param.var.value = n;
+            } else if (vec_nth(args, 0).type == OP_ARG) {
+                expr_frame[vec_nth(args, 0).param.arg.index] = n;
+            }
+            break;
+        case OP_LOGICAL_AND:
+            if (d->state++ == 0) {
+                DFS_PUSH(&vec_nth(args, 0));
+                continue;
+            }
+            n = s.values[--s.nvalues];
+            if (d->state == 2 && n != 0) {
+                DFS_PUSH(&vec_nth(args, 1));
+                continue;
+            }
+            n = (n != 0 ? n : 0);
+            break;
+        case OP_LOGICAL_OR:
+            if (d->state++ == 0) {
+                DFS_PUSH(&vec_nth(args, 0));
+                continue;
+            }
+            n = s.values[--s.nvalues];
+            if (d->state == 2 && (n == 0 || isnan(n))) {
+                DFS_PUSH(&vec_nth(args, 1));
+                continue;
+            }
+            n = (n != 0 ? n : 0);
+            break;
+        case OP_FUNC:
+            if (x->param.func.f->f) {
+                n = expr_func_eval(x);
+                break;
+            }
+            args = &x->param.func.args;
+            if (d->state < vec_len(args)) {
+                DFS_PUSH(&vec_nth(args, d->state++));
+                continue;
+            }
+            s.nvalues -= vec_len(args);
+            n = x->param.func.f->native(x->param.func.f,
+                &s.values[s.nvalues], vec_len(args), x->param.func.context);
+            break;
+        case OP_CALL:
+            args = &x->param.call.args;
+            if (d->state == 0) {
+                d->base = s.nvalues;
+            }
+            if (d->state < vec_len(args)) {
+                DFS_PUSH(&vec_nth(args, d->state++));
+                continue;
             }
+            if (d->state++ == vec_len(args)) {
+                /* Missing arguments are zero, extra ones stay unused */
+                struct expr_macro *m = x->param.call.macro;
+                while (s.nvalues - d->base < m->nparams) {
+                    DFS_VALUE(0);
+                }
+                d->caller = s.frame;
+                s.frame = d->base;
+                expr_frame = &s.values[s.frame];
+                DFS_PUSH(&m->body);
+                continue;
+            }
+            n = s.values[--s.nvalues];
+            s.nvalues = d->base;
+            s.frame = d->caller;
+            expr_frame = (s.frame >= 0 ? &s.values[s.frame] : s.outer);
+            break;
+        case OP_UNKNOWN:
+            n = NAN;
+            break;
+        default:
+            if (d->state < vec_len(args)) {
+                DFS_PUSH(&vec_nth(args, d->state++));
+                continue;
+            }
+            s.nvalues -= vec_len(args);
+            n = expr_apply(x->type, &s.values[s.nvalues]);
+            break;
         }
+        s.nnodes--;
+        DFS_VALUE(n);
     }
-
-    return tmp_val[0];
+#undef DFS_PUSH
+#undef DFS_VALUE
+    result = s.values[0];
+cleanup:
+    if (s.nnodes > 0) { /* out of memory midway */
+        expr_frame = s.outer;
+    }
+    if (s.nodes != nodes) {
+        free(s.nodes);
+    }
+    if (s.values != values) {
+        free(s.values);
+    }
+    return result;
 }
 
 float expr_eval_with_asm(struct expr *e)
@@ -382,7 +986,6 @@ float expr_eval_with_asm(struct expr *e)
             : "=m" ( n )
             : "m" ( a ), "m" ( b )
         );
-        printf("%f\n", n);
         return n;
     case OP_SHL:
         return to_int(expr_eval_with_asm(&e->param.op.args.buf[0]))
@@ -438,10 +1041,11 @@ float expr_eval_with_asm(struct expr *e)
         }
         return 0;
     case OP_ASSIGN:
+        a = expr_eval_with_asm(&e->param.op.args.buf[1]);
         asm("fld %1;"
             "fstp %0;"
             : "=m" ( n )
-            : "m" ( e->param.op.args.buf[1].param.num.value )
+            : "m" ( a )
         );
 
         if (vec_nth(&e->param.op.args, 0).type == OP_VAR) {
@@ -450,6 +1054,8 @@ float expr_eval_with_asm(struct expr *e)
                 : "=m" ( *e->param.op.args.buf[0].param.var.value )
                 : "m" ( n )
             );
+        } else if (vec_nth(&e->param.op.args, 0).type == OP_ARG) {
+            expr_frame[e->param.op.args.buf[0].param.arg.index] = n;
         }
         return n;
     case OP_COMMA:
@@ -460,9 +1066,15 @@ float expr_eval_with_asm(struct expr *e)
     case OP_VAR:
         return *e->param.var.value;
     case OP_FUNC:
-        return e->param.func.f->f(
-            e->param.func.f, e->param.func.args, e->param.func.context);
+        return expr_func_eval(e);
+    case OP_CALL:
+        return expr_call(e);
+    case OP_ARG:
+        return expr_frame[e->param.arg.index];
     default:
+        if (expr_is_builtin(e->type)) {
+            return expr_eval(e);
+        }
         return NAN;
     }
 }
@@ -470,7 +1082,7 @@ float expr_eval_with_asm(struct expr *e)
 
 float expr_eval(struct expr *e)
 {
-    float n;
+    float n, a, b;
     switch (e->type) {
     case OP_UNARY_MINUS:
         return -(expr_eval(&e->param.op.args.buf[0]));
@@ -479,56 +1091,56 @@ float expr_eval(struct expr *e)
     case OP_UNARY_BITWISE_NOT:
         return ~(to_int(expr_eval(&e->param.op.args.buf[0])));
     case OP_POWER:
-        return powf(expr_eval(&e->param.op.args.buf[0]),
-            expr_eval(&e->param.op.args.buf[1]));
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return powf(a, expr_eval(&e->param.op.args.buf[1]));
     case OP_MULTIPLY:
-        return expr_eval(&e->param.op.args.buf[0])
-            * expr_eval(&e->param.op.args.buf[1]);
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return a * expr_eval(&e->param.op.args.buf[1]);
     case OP_DIVIDE:
-        return expr_eval(&e->param.op.args.buf[0])
-            / expr_eval(&e->param.op.args.buf[1]);
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return a / expr_eval(&e->param.op.args.buf[1]);
     case OP_REMAINDER:
-        return fmodf(expr_eval(&e->param.op.args.buf[0]),
-            expr_eval(&e->param.op.args.buf[1]));
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return fmodf(a, expr_eval(&e->param.op.args.buf[1]));
     case OP_PLUS:
-        return expr_eval(&e->param.op.args.buf[0])
-            + expr_eval(&e->param.op.args.buf[1]);
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return a + expr_eval(&e->param.op.args.buf[1]);
     case OP_MINUS:
-        return expr_eval(&e->param.op.args.buf[0])
-            - expr_eval(&e->param.op.args.buf[1]);
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return a - expr_eval(&e->param.op.args.buf[1]);
     case OP_SHL:
-        return to_int(expr_eval(&e->param.op.args.buf[0]))
-            << to_int(expr_eval(&e->param.op.args.buf[1]));
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return to_int(a) << to_int(expr_eval(&e->param.op.args.buf[1]));
     case OP_SHR:
-        return to_int(expr_eval(&e->param.op.args.buf[0]))
-            >> to_int(expr_eval(&e->param.op.args.buf[1]));
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return to_int(a) >> to_int(expr_eval(&e->param.op.args.buf[1]));
     case OP_LT:
-        return expr_eval(&e->param.op.args.buf[0])
-            < expr_eval(&e->param.op.args.buf[1]);
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return a < expr_eval(&e->param.op.args.buf[1]);
     case OP_LE:
-        return expr_eval(&e->param.op.args.buf[0])
-            <= expr_eval(&e->param.op.args.buf[1]);
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return a <= expr_eval(&e->param.op.args.buf[1]);
     case OP_GT:
-        return expr_eval(&e->param.op.args.buf[0])
-            > expr_eval(&e->param.op.args.buf[1]);
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return a > expr_eval(&e->param.op.args.buf[1]);
     case OP_GE:
-        return expr_eval(&e->param.op.args.buf[0])
-            >= expr_eval(&e->param.op.args.buf[1]);
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return a >= expr_eval(&e->param.op.args.buf[1]);
     case OP_EQ:
-        return expr_eval(&e->param.op.args.buf[0])
-            == expr_eval(&e->param.op.args.buf[1]);
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return a == expr_eval(&e->param.op.args.buf[1]);
     case OP_NE:
-        return expr_eval(&e->param.op.args.buf[0])
-            != expr_eval(&e->param.op.args.buf[1]);
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return a != expr_eval(&e->param.op.args.buf[1]);
     case OP_BITWISE_AND:
-        return to_int(expr_eval(&e->param.op.args.buf[0]))
-            & to_int(expr_eval(&e->param.op.args.buf[1]));
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return to_int(a) & to_int(expr_eval(&e->param.op.args.buf[1]));
     case OP_BITWISE_OR:
-        return to_int(expr_eval(&e->param.op.args.buf[0]))
-            | to_int(expr_eval(&e->param.op.args.buf[1]));
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return to_int(a) | to_int(expr_eval(&e->param.op.args.buf[1]));
     case OP_BITWISE_XOR:
-        return to_int(expr_eval(&e->param.op.args.buf[0]))
-            ^ to_int(expr_eval(&e->param.op.args.buf[1]));
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return to_int(a) ^ to_int(expr_eval(&e->param.op.args.buf[1]));
     case OP_LOGICAL_AND:
         n = expr_eval(&e->param.op.args.buf[0]);
         if (n != 0) {
@@ -553,6 +1165,8 @@ float expr_eval(struct expr *e)
         n = expr_eval(&e->param.op.args.buf[1]);
         if (vec_nth(&e->param.op.args, 0).type == OP_VAR) {
             *e->param.op.args.buf[0].param.var.value = n;
+        } else if (vec_nth(&e->param.op.args, 0).type == OP_ARG) {
+            expr_frame[e->param.op.args.buf[0].param.arg.index] = n;
         }
         return n;
     case OP_COMMA:
@@ -563,8 +1177,47 @@ float expr_eval(struct expr *e)
     case OP_VAR:
         return *e->param.var.value;
     case OP_FUNC:
-        return e->param.func.f->f(
-            e->param.func.f, e->param.func.args, e->param.func.context);
+        return expr_func_eval(e);
+    case OP_SQRT:
+        return sqrtf(expr_eval(&e->param.op.args.buf[0]));
+    case OP_ABS:
+        return fabsf(expr_eval(&e->param.op.args.buf[0]));
+    case OP_FLOOR:
+        return floorf(expr_eval(&e->param.op.args.buf[0]));
+    case OP_CEIL:
+        return ceilf(expr_eval(&e->param.op.args.buf[0]));
+    case OP_EXP:
+        return expf(expr_eval(&e->param.op.args.buf[0]));
+    case OP_LOG:
+        return logf(expr_eval(&e->param.op.args.buf[0]));
+    case OP_SIN:
+        return sinf(expr_eval(&e->param.op.args.buf[0]));
+    case OP_COS:
+        return cosf(expr_eval(&e->param.op.args.buf[0]));
+    case OP_MIN:
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return expr_min(a, expr_eval(&e->param.op.args.buf[1]));
+    case OP_MAX:
+        a = expr_eval(&e->param.op.args.buf[0]);
+        return expr_max(a, expr_eval(&e->param.op.args.buf[1]));
+    case OP_CLAMP:
+        a = expr_eval(&e->param.op.args.buf[0]);
+        b = expr_eval(&e->param.op.args.buf[1]);
+        return expr_min(
+            expr_max(a, b), expr_eval(&e->param.op.args.buf[2]));
+    case OP_FMA:
+        a = expr_eval(&e->param.op.args.buf[0]);
+        b = expr_eval(&e->param.op.args.buf[1]);
+        return fmaf(a, b, expr_eval(&e->param.op.args.buf[2]));
+    case OP_SELECT:
+        n = expr_eval(&e->param.op.args.buf[0]);
+        a = expr_eval(&e->param.op.args.buf[1]);
+        b = expr_eval(&e->param.op.args.buf[2]);
+        return expr_select(n, a, b);
+    case OP_CALL:
+        return expr_call(e);
+    case OP_ARG:
+        return expr_frame[e->param.arg.index];
     default:
         return NAN;
     }
@@ -572,7 +1225,7 @@ float expr_eval(struct expr *e)
 
 int expr_next_token(const char *s, size_t len, int *flags)
 {
-    unsigned int i = 0;
+    size_t i = 0;
     if (len == 0) {
         return 0;
     }
@@ -582,7 +1235,7 @@ int expr_next_token(const char *s, size_t len, int *flags)
             ;
         return i;
     } else if (c == '\n') {
-        for (; i < len && isspace(s[i]); i++)
+        for (; i < len && expr_isspace(s[i]); i++)
             ;
         if (*flags & EXPR_TOP) {
             if (i == len || s[i] == ')') {
@@ -592,19 +1245,27 @@ int expr_next_token(const char *s, size_t len, int *flags)
             }
         }
         return i;
-    } else if (isspace(c)) {
-        while (i < len && isspace(s[i]) && s[i] != '\n') {
+    } else if (expr_isspace(c)) {
+        while (i < len && expr_isspace(s[i]) && s[i] != '\n') {
             i++;
         }
         return i;
-    } else if (isdigit(c)) {
+    } else if (expr_isdigit(c)) {
         if ((*flags & EXPR_TNUMBER) == 0) {
             return -1; // unexpected number
         }
         *flags = EXPR_TOP | EXPR_TCLOSE;
-        while ((c == '.' || isdigit(c)) && i < len) {
-            i++;
-            c = s[i];
+        /* Digits, letters and dots, signs only right after the exponent
+         * mark: "e" in decimal and "p" in hexadecimal literals */
+        char mark = (len > 1 && (s[1] == 'x' || s[1] == 'X') ? 'p' : 'e');
+        for (; i < len; i++) {
+            int lower = s[i] | 0x20;
+            if (!expr_isdigit(s[i]) && s[i] != '.'
+                && !(lower >= 'a' && lower <= 'z')
+                && !((s[i] == '+' || s[i] == '-')
+                    && (s[i - 1] | 0x20) == mark)) {
+                break;
+            }
         }
         return i;
     } else if (isfirstvarchr(c)) {
@@ -612,9 +1273,8 @@ int expr_next_token(const char *s, size_t len, int *flags)
             return -2; // unexpected word
         }
         *flags = EXPR_TOP | EXPR_TOPEN | EXPR_TCLOSE;
-        while ((isvarchr(c)) && i < len) {
+        while (i < len && isvarchr(s[i])) {
             i++;
-            c = s[i];
         }
         return i;
     } else if (c == '(' || c == ')') {
@@ -626,39 +1286,216 @@ int expr_next_token(const char *s, size_t len, int *flags)
             return -3; // unexpected parenthesis
         }
         return 1;
+    } else if ((*flags & EXPR_TOP) == 0) {
+        if (expr_op(&c, 1, 1) == OP_UNKNOWN) {
+            return -4; // missing expected operand
+        }
+        *flags = EXPR_TNUMBER | EXPR_TWORD | EXPR_TOPEN | EXPR_UNARY;
+        return 1;
     } else {
-        if ((*flags & EXPR_TOP) == 0) {
-            if (expr_op(&c, 1, 1) == OP_UNKNOWN) {
-                return -4; // missing expected operand
-            }
-            *flags = EXPR_TNUMBER | EXPR_TWORD | EXPR_TOPEN | EXPR_UNARY;
-            return 1;
-        } else {
-            int found = 0;
-            while (!isvarchr(c) && !isspace(c) && c != '(' && c != ')'
-                && i < len) {
-                if (expr_op(s, i + 1, 0) != OP_UNKNOWN) {
-                    found = 1;
-                } else if (found) {
-                    break;
-                }
-                i++;
-                c = s[i];
-            }
-            if (!found) {
-                return -5; // unknown operator
-            }
-            *flags = EXPR_TNUMBER | EXPR_TWORD | EXPR_TOPEN;
-            return i;
+        /* The longest binary operator wins */
+        int n = (len > 1 && expr_op(s, 2, 0) != OP_UNKNOWN)
+            ? 2
+            : (expr_op(s, 1, 0) != OP_UNKNOWN) ? 1 : 0;
+        if (n == 0) {
+            return -5; // unknown operator
+        }
+        *flags = EXPR_TNUMBER | EXPR_TWORD | EXPR_TOPEN;
+        return n;
+    }
+}
+
+/*
+ * Arenas. Blocks are chained newest first and memory is handed out by
+ * bumping an offset, nothing is freed until the arena is reset. Function
+ * contexts with a cleanup callback are remembered so that reset can call it.
+ */
+#define EXPR_ARENA_ALIGN 16
+#define EXPR_ARENA_BLOCK 4096
+
+struct expr_arena_block {
+    struct expr_arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+struct expr_arena_cleanup {
+    struct expr_arena_cleanup *next;
+    struct expr_func *f;
+    void *context;
+};
+
+struct expr_arena {
+    struct expr_arena_block *blocks;
+    struct expr_arena_cleanup *cleanups;
+    size_t blocksz;
+};
+
+#define EXPR_ARENA_HEADER                                                     \
+    ((sizeof(struct expr_arena_block) + EXPR_ARENA_ALIGN - 1)                 \
+        & ~(size_t)(EXPR_ARENA_ALIGN - 1))
+
+static struct expr_arena_block *expr_arena_block(size_t size)
+{
+    struct expr_arena_block *b = malloc(EXPR_ARENA_HEADER + size);
+    if (b) {
+        b->next = NULL;
+        b->size = size;
+        b->used = 0;
+    }
+    return b;
+}
+
+struct expr_arena *expr_arena_create(size_t size)
+{
+    struct expr_arena *a = calloc(1, sizeof(struct expr_arena));
+    if (a == NULL) {
+        return NULL;
+    }
+    a->blocksz = size > 0 ? size : EXPR_ARENA_BLOCK;
+    if ((a->blocks = expr_arena_block(a->blocksz)) == NULL) {
+        free(a);
+        return NULL;
+    }
+    return a;
+}
+
+/* Returns zeroed memory, like calloc() */
+static void *expr_arena_alloc(struct expr_arena *a, size_t size)
+{
+    struct expr_arena_block *b = a->blocks;
+    size = (size + EXPR_ARENA_ALIGN - 1) & ~(size_t)(EXPR_ARENA_ALIGN - 1);
+    if (b == NULL || b->size - b->used < size) {
+        size_t n = size > a->blocksz ? size : a->blocksz;
+        if ((b = expr_arena_block(n)) == NULL) {
+            return NULL;
+        }
+        b->next = a->blocks;
+        a->blocks = b;
+    }
+    void *p = (char *)b + EXPR_ARENA_HEADER + b->used;
+    b->used += size;
+    return memset(p, 0, size);
+}
+
+void expr_arena_reset(struct expr_arena *a)
+{
+    for (struct expr_arena_cleanup *c = a->cleanups; c; c = c->next) {
+        c->f->cleanup(c->f, c->context);
+    }
+    a->cleanups = NULL;
+    /* Replace a chain of blocks by a single one large enough to hold it all,
+     * so that a steady workload stops allocating after the first rounds */
+    if (a->blocks->next) {
+        size_t total = 0;
+        for (struct expr_arena_block *b = a->blocks; b;) {
+            struct expr_arena_block *next = b->next;
+            total += b->size;
+            free(b);
+            b = next;
+        }
+        if ((a->blocks = expr_arena_block(total)) != NULL) {
+            a->blocksz = total;
+        } else {
+            a->blocks = expr_arena_block(a->blocksz);
+        }
+    }
+    if (a->blocks) {
+        a->blocks->used = 0;
+    }
+}
+
+void expr_arena_destroy(struct expr_arena *a)
+{
+    if (a == NULL) {
+        return;
+    }
+    expr_arena_reset(a);
+    free(a->blocks);
+    free(a);
+}
+
+/*
+ * Node storage, taken from the arena when there is one and from the heap
+ * otherwise.
+ */
+static int expr_args_push(struct expr_arena *a, vec_expr_t *v, struct expr e)
+{
+    if (a == NULL) {
+        return vec_push(v, e);
+    }
+    if (v->len + 1 > v->cap) {
+        int n = (v->cap == 0) ? 2 : v->cap << 1;
+        struct expr *buf = expr_arena_alloc(a, n * sizeof(struct expr));
+        if (buf == NULL) {
+            return -1;
+        }
+        if (v->len > 0) {
+            memcpy(buf, v->buf, v->len * sizeof(struct expr));
+        }
+        v->buf = buf;
+        v->cap = n;
+    }
+    v->buf[v->len++] = e;
+    return 0;
+}
+
+static void expr_args_free(struct expr_arena *a, vec_expr_t *v)
+{
+    if (a == NULL) {
+        vec_free(v);
+    }
+}
+
+static void *expr_context(struct expr_arena *a, struct expr_func *f)
+{
+    if (a == NULL) {
+        return calloc(1, f->ctxsz);
+    }
+    void *p = expr_arena_alloc(a, f->ctxsz);
+    if (p && f->cleanup) {
+        struct expr_arena_cleanup *c
+            = expr_arena_alloc(a, sizeof(struct expr_arena_cleanup));
+        if (c == NULL) {
+            return NULL;
         }
+        c->f = f;
+        c->context = p;
+        c->next = a->cleanups;
+        a->cleanups = c;
     }
+    return p;
 }
 
 #define EXPR_PAREN_ALLOWED 0
 #define EXPR_PAREN_EXPECTED 1
 #define EXPR_PAREN_FORBIDDEN 2
 
-static int expr_bind(const char *s, size_t len, vec_expr_t *es)
+static struct expr expr_const(float value);
+
+/* Operators on constants are evaluated right away, with the same rules as
+ * expr_eval(). Returns 1 if the operator was folded into result. */
+static int expr_fold(
+    enum expr_type op, struct expr *args, int n, struct expr *result)
+{
+    if (op == OP_ASSIGN) {
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        if (args[i].type != OP_CONST) {
+            return 0;
+        }
+    }
+    struct expr e = expr_init();
+    e.type = op;
+    e.param.op.args.buf = args;
+    e.param.op.args.len = e.param.op.args.cap = n;
+    *result = expr_const(expr_eval(&e));
+    return 1;
+}
+
+static int expr_bind(
+    struct expr_arena *a, const char *s, size_t len, vec_expr_t *es)
 {
     enum expr_type op = expr_op(s, len, -1);
     if (op == OP_UNKNOWN) {
@@ -671,22 +1508,35 @@ static int expr_bind(const char *s, size_t len, vec_expr_t *es)
         }
         struct expr arg = vec_pop(es);
         struct expr unary = expr_init();
+        if (expr_fold(op, &arg, 1, &unary)) {
+            vec_push(es, unary);
+            return 0;
+        }
         unary.type = op;
-        vec_push(&unary.param.op.args, arg);
+        if (expr_args_push(a, &unary.param.op.args, arg) == -1) {
+            return -1;
+        }
         vec_push(es, unary);
     } else {
         if (vec_len(es) < 2) {
             return -1;
         }
-        struct expr b = vec_pop(es);
-        struct expr a = vec_pop(es);
+        struct expr args[2];
+        args[1] = vec_pop(es);
+        args[0] = vec_pop(es);
         struct expr binary = expr_init();
-        binary.type = op;
-        if (op == OP_ASSIGN && a.type != OP_VAR) {
+        if (op == OP_ASSIGN && args[0].type != OP_VAR) {
             return -1; /* Bad assignment */
         }
-        vec_push(&binary.param.op.args, a);
-        vec_push(&binary.param.op.args, b);
+        if (expr_fold(op, args, 2, &binary)) {
+            vec_push(es, binary);
+            return 0;
+        }
+        binary.type = op;
+        if (expr_args_push(a, &binary.param.op.args, args[0]) == -1
+            || expr_args_push(a, &binary.param.op.args, args[1]) == -1) {
+            return -1;
+        }
         vec_push(es, binary);
     }
     return 0;
@@ -708,50 +1558,112 @@ static struct expr expr_varref(struct expr_var *v)
     return e;
 }
 
-static struct expr expr_binary(
+static struct expr expr_binary(struct expr_arena *arena,
     enum expr_type type, struct expr a, struct expr b)
 {
     struct expr e = expr_init();
     e.type = type;
-    vec_push(&e.param.op.args, a);
-    vec_push(&e.param.op.args, b);
+    expr_args_push(arena, &e.param.op.args, a);
+    expr_args_push(arena, &e.param.op.args, b);
     return e;
 }
 
-static inline void expr_copy(struct expr *dst, struct expr *src)
+static void expr_destroy_args(struct expr *e);
+
+#define EXPR_MAX_PARAMS 256
+
+/* Turns $1, $2... into arguments, returns the highest one referenced */
+static int expr_macro_params(struct expr *e)
 {
-    int i;
-    struct expr arg;
-    dst->type = src->type;
-    if (src->type == OP_FUNC) {
-        dst->param.func.f = src->param.func.f;
-        vec_foreach(&src->param.func.args, arg, i)
-        {
-            struct expr tmp = expr_init();
-            expr_copy(&tmp, &arg);
-            vec_push(&dst->param.func.args, tmp);
+    int i, k = 0, n = 0;
+    vec_expr_t *args;
+    switch (e->type) {
+    case OP_CONST:
+    case OP_ARG:
+        return 0;
+    case OP_VAR: {
+        const char *name = ((struct expr_var *)e->param.var.value)->name;
+        if (name[0] != '$' || name[1] == '\0') {
+            return 0;
         }
-        if (src->param.func.f->ctxsz > 0) {
-            dst->param.func.context = calloc(1, src->param.func.f->ctxsz);
+        for (name++; *name; name++) {
+            if (!expr_isdigit(*name) || k > EXPR_MAX_PARAMS) {
+                return 0;
+            }
+            k = k * 10 + (*name - '0');
+        }
+        if (k < 1 || k > EXPR_MAX_PARAMS) {
+            return 0;
         }
-    } else if (src->type == OP_CONST) {
-        dst->param.num.value = src->param.num.value;
-    } else if (src->type == OP_VAR) {
-        dst->param.var.value = src->param.var.value;
+        e->type = OP_ARG;
+        e->param.arg.index = k - 1;
+        return k;
+    }
+    case OP_FUNC:
+        args = &e->param.func.args;
+        break;
+    case OP_CALL:
+        args = &e->param.call.args;
+        break;
+    default:
+        args = &e->param.op.args;
+        break;
+    }
+    for (i = 0; i < vec_len(args); i++) {
+        k = expr_macro_params(&vec_nth(args, i));
+        n = (k > n ? k : n);
+    }
+    return n;
+}
+
+/* Takes the body out of the arguments of $(name, body...) */
+static struct expr_macro *expr_macro_create(
+    struct expr_arena *arena, vec_expr_t *args)
+{
+    struct expr_macro *m;
+    if (arena) {
+        m = (struct expr_macro *)expr_arena_alloc(arena, sizeof(*m));
     } else {
-        vec_foreach(&src->param.op.args, arg, i)
-        {
-            struct expr tmp = expr_init();
-            expr_copy(&tmp, &arg);
-            vec_push(&dst->param.op.args, tmp);
+        m = (struct expr_macro *)calloc(1, sizeof(*m));
+    }
+    if (m == NULL) {
+        return NULL;
+    }
+    m->refs = 1;
+    m->body = expr_const(0);
+    for (int i = vec_len(args) - 1; i > 0; i--) {
+        if (i == vec_len(args) - 1) {
+            m->body = vec_nth(args, i);
+        } else {
+            m->body = expr_binary(arena, OP_COMMA, vec_nth(args, i), m->body);
         }
     }
+    m->nparams = expr_macro_params(&m->body);
+    expr_args_free(arena, args);
+    return m;
 }
 
-static void expr_destroy_args(struct expr *e);
+static void expr_macro_release(struct expr_macro *m)
+{
+    if (--m->refs == 0) {
+        expr_destroy_args(&m->body);
+        free(m);
+    }
+}
 
-struct expr *expr_create(const char *s, size_t len,
-    struct expr_var_list *vars, struct expr_func *funcs)
+/* Functions come from the registry when there is one */
+static struct expr_func *expr_parse_func(struct expr_func *funcs,
+    struct expr_func_registry *registry, const char *s, size_t len)
+{
+    if (registry) {
+        return expr_func_registry_find(registry, s, len);
+    }
+    return expr_func(funcs, s, len);
+}
+
+static struct expr *expr_parse(struct expr_arena *arena, const char *s,
+    size_t len, struct expr_var_list *vars, struct expr_func *funcs,
+    struct expr_func_registry *registry)
 {
     float num;
     struct expr_var *v;
@@ -766,7 +1678,7 @@ struct expr *expr_create(const char *s, size_t len,
 
     struct macro {
         char *name;
-        vec_expr_t body;
+        struct expr_macro *fn;
     };
     vec(struct macro) macros = vec_init();
 
@@ -808,7 +1720,7 @@ struct expr *expr_create(const char *s, size_t len,
             n = 1;
             tok = ",";
         }
-        if (isspace(*tok)) {
+        if (expr_isspace(*tok)) {
             continue;
         }
         int paren_next = EXPR_PAREN_ALLOWED;
@@ -827,7 +1739,8 @@ struct expr *expr_create(const char *s, size_t len,
                     }
                 }
                 if ((idn == 1 && id[0] == '$') || has_macro
-                    || expr_func(funcs, id, idn)) {
+                    || expr_parse_func(funcs, registry, id, idn)
+                    || expr_builtin(id, idn)) {
                     struct expr_string str = { id, (int)idn };
                     vec_push(&os, str);
                     paren = EXPR_PAREN_EXPECTED;
@@ -862,7 +1775,7 @@ struct expr *expr_create(const char *s, size_t len,
             while (vec_len(&os) > minlen && *vec_peek(&os).s != '('
                 && *vec_peek(&os).s != '{') {
                 struct expr_string str = vec_pop(&os);
-                if (expr_bind(str.s, str.n, &es) == -1) {
+                if (expr_bind(arena, str.s, str.n, &es) == -1) {
                     goto cleanup;
                 }
             }
@@ -874,24 +1787,26 @@ struct expr *expr_create(const char *s, size_t len,
                 str = vec_pop(&os);
                 struct expr_arg arg = vec_pop(&as);
                 if (vec_len(&es) > arg.eslen) {
-                    vec_push(&arg.args, vec_pop(&es));
+                    expr_args_push(arena, &arg.args, vec_pop(&es));
                 }
                 if (str.n == 1 && str.s[0] == '$') {
                     if (vec_len(&arg.args) < 1) {
-                        vec_free(&arg.args);
+                        expr_args_free(arena, &arg.args);
                         goto cleanup; /* too few arguments for $() function */
                     }
                     struct expr *u = &vec_nth(&arg.args, 0);
                     if (u->type != OP_VAR) {
-                        vec_free(&arg.args);
+                        expr_args_free(arena, &arg.args);
                         goto cleanup; /* first argument is not a variable */
                     }
-                    for (struct expr_var *v = vars->head; v; v = v->next) {
-                        if (&v->value == u->param.var.value) {
-                            struct macro m = { v->name, arg.args };
-                            vec_push(&macros, m);
-                            break;
+                    struct expr_var *v = (struct expr_var *)u->param.var.value;
+                    struct macro m = { v->name, NULL };
+                    m.fn = expr_macro_create(arena, &arg.args);
+                    if (m.fn == NULL || vec_push(&macros, m) == -1) {
+                        if (m.fn && arena == NULL) {
+                            expr_macro_release(m.fn);
                         }
+                        goto cleanup; /* allocation failed */
                     }
                     vec_push(&es, expr_const(0));
                 } else {
@@ -907,43 +1822,42 @@ struct expr *expr_create(const char *s, size_t len,
                     }
                     if (found != -1) {
                         m = vec_nth(&macros, found);
-                        struct expr root = expr_const(0);
-                        struct expr *p = &root;
-                        /* Assign macro parameters */
-                        for (int j = 0; j < vec_len(&arg.args); j++) {
-                            char varname[4];
-                            snprintf(
-                                varname, sizeof(varname) - 1, "$%d", (j + 1));
-                            struct expr_var *v
-                                = expr_var(vars, varname, strlen(varname));
-                            struct expr ev = expr_varref(v);
-                            struct expr assign = expr_binary(
-                                OP_ASSIGN, ev, vec_nth(&arg.args, j));
-                            *p = expr_binary(OP_COMMA, assign, expr_const(0));
-                            p = &vec_nth(&p->param.op.args, 1);
-                        }
-                        /* Expand macro body */
-                        for (int j = 1; j < vec_len(&m.body); j++) {
-                            if (j < vec_len(&m.body) - 1) {
-                                *p = expr_binary(
-                                    OP_COMMA, expr_const(0), expr_const(0));
-                                expr_copy(&vec_nth(&p->param.op.args, 0),
-                                    &vec_nth(&m.body, j));
-                            } else {
-                                expr_copy(p, &vec_nth(&m.body, j));
+                        struct expr call = expr_init();
+                        call.type = OP_CALL;
+                        call.param.call.args = arg.args;
+                        call.param.call.macro = m.fn;
+                        m.fn->refs++;
+                        vec_push(&es, call);
+                    } else if (!expr_parse_func(
+                                   funcs, registry, str.s, str.n)) {
+                        const struct expr_builtin *b
+                            = expr_builtin(str.s, str.n);
+                        struct expr call = expr_init();
+                        if (vec_len(&arg.args) != b->nargs) {
+                            for (int k = 0; !arena && k < vec_len(&arg.args);
+                                 k++) {
+                                expr_destroy_args(&vec_nth(&arg.args, k));
                             }
-                            p = &vec_nth(&p->param.op.args, 1);
+                            expr_args_free(arena, &arg.args);
+                            goto cleanup; /* wrong number of arguments */
                         }
-                        vec_push(&es, root);
-                        vec_free(&arg.args);
+                        if (expr_fold(
+                                b->op, arg.args.buf, b->nargs, &call)) {
+                            expr_args_free(arena, &arg.args);
+                        } else {
+                            call.type = b->op;
+                            call.param.op.args = arg.args;
+                        }
+                        vec_push(&es, call);
                     } else {
-                        struct expr_func *f = expr_func(funcs, str.s, str.n);
+                        struct expr_func *f
+                            = expr_parse_func(funcs, registry, str.s, str.n);
                         struct expr bound_func = expr_init();
                         bound_func.type = OP_FUNC;
                         bound_func.param.func.f = f;
                         bound_func.param.func.args = arg.args;
                         if (f->ctxsz > 0) {
-                            void *p = calloc(1, f->ctxsz);
+                            void *p = expr_context(arena, f);
                             if (!p) {
                                 goto cleanup; /* allocation failed */
                             }
@@ -968,7 +1882,7 @@ struct expr *expr_create(const char *s, size_t len,
                     struct expr_string str = vec_peek(&os);
                     if (str.n == 1 && *str.s == '{') {
                         struct expr e = vec_pop(&es);
-                        vec_push(&vec_peek(&as).args, e);
+                        expr_args_push(arena, &vec_peek(&as).args, e);
                         break;
                     }
                 }
@@ -979,7 +1893,7 @@ struct expr *expr_create(const char *s, size_t len,
                     break;
                 }
 
-                if (expr_bind(o2.s, o2.n, &es) == -1) {
+                if (expr_bind(arena, o2.s, o2.n, &es) == -1) {
                     goto cleanup;
                 }
                 (void)vec_pop(&os);
@@ -990,7 +1904,7 @@ struct expr *expr_create(const char *s, size_t len,
                 }
             }
         } else {
-            if (n > 0 && !isdigit(*tok)) {
+            if (n > 0 && !expr_isdigit(*tok)) {
                 /* Valid identifier, a variable or a function */
                 id = tok;
                 idn = n;
@@ -1010,12 +1924,16 @@ struct expr *expr_create(const char *s, size_t len,
         if (rest.n == 1 && (*rest.s == '(' || *rest.s == ')')) {
             goto cleanup; // Bad paren
         }
-        if (expr_bind(rest.s, rest.n, &es) == -1) {
+        if (expr_bind(arena, rest.s, rest.n, &es) == -1) {
             goto cleanup;
         }
     }
 
-    result = (struct expr *)calloc(1, sizeof(struct expr));
+    if (arena) {
+        result = (struct expr *)expr_arena_alloc(arena, sizeof(struct expr));
+    } else {
+        result = (struct expr *)calloc(1, sizeof(struct expr));
+    }
     if (result) {
         if (vec_len(&es) == 0) {
             result->type = OP_CONST;
@@ -1029,22 +1947,18 @@ struct expr *expr_create(const char *s, size_t len,
     struct expr e;
     struct expr_arg a;
 cleanup:
-    vec_foreach(&macros, m, i)
-    {
-        struct expr e;
-        vec_foreach(&m.body, e, j) { expr_destroy_args(&e); }
-        vec_free(&m.body);
+    /* Trees built in an arena stay there until it is reset */
+    if (arena == NULL) {
+        vec_foreach(&macros, m, i) { expr_macro_release(m.fn); }
+        vec_foreach(&es, e, i) { expr_destroy_args(&e); }
+        vec_foreach(&as, a, i)
+        {
+            vec_foreach(&a.args, e, j) { expr_destroy_args(&e); }
+            vec_free(&a.args);
+        }
     }
     vec_free(&macros);
-
-    vec_foreach(&es, e, i) { expr_destroy_args(&e); }
     vec_free(&es);
-
-    vec_foreach(&as, a, i)
-    {
-        vec_foreach(&a.args, e, j) { expr_destroy_args(&e); }
-        vec_free(&a.args);
-    }
     vec_free(&as);
 
     /*vec_foreach(&os, o, i) {vec_free(&m.body);}*/
@@ -1052,13 +1966,30 @@ cleanup:
     return result;
 }
 
-static void expr_destroy_args(struct expr *e)
+struct expr *expr_create(const char *s, size_t len,
+    struct expr_var_list *vars, struct expr_func *funcs)
+{
+    return expr_parse(NULL, s, len, vars, funcs, NULL);
+}
+
+struct expr *expr_create_in(struct expr_arena *arena, const char *s,
+    size_t len, struct expr_var_list *vars, struct expr_func *funcs)
+{
+    return expr_parse(arena, s, len, vars, funcs, NULL);
+}
+
+struct expr *expr_create_with(struct expr_arena *arena, const char *s,
+    size_t len, struct expr_var_list *vars,
+    struct expr_func_registry *registry)
+{
+    return expr_parse(arena, s, len, vars, NULL, registry);
+}
+
+/* Releases what the node itself owns and hands back its arguments */
+static vec_expr_t expr_unlink(struct expr *e)
 {
-    int i;
-    struct expr arg;
+    vec_expr_t none = vec_init();
     if (e->type == OP_FUNC) {
-        vec_foreach(&e->param.func.args, arg, i) { expr_destroy_args(&arg); }
-        vec_free(&e->param.func.args);
         if (e->param.func.context) {
             if (e->param.func.f->cleanup) {
                 e->param.func.f->cleanup(
@@ -1066,9 +1997,52 @@ static void expr_destroy_args(struct expr *e)
             }
             free(e->param.func.context);
         }
-    } else if (e->type != OP_CONST && e->type != OP_VAR) {
-        vec_foreach(&e->param.op.args, arg, i) { expr_destroy_args(&arg); }
-        vec_free(&e->param.op.args);
+        return e->param.func.args;
+    } else if (e->type == OP_CALL) {
+        expr_macro_release(e->param.call.macro);
+        return e->param.call.args;
+    } else if (e->type != OP_CONST && e->type != OP_VAR
+        && e->type != OP_ARG) {
+        return e->param.op.args;
+    }
+    return none;
+}
+
+/* Frees argument vectors and everything below them without recursion.
+ * Vectors wait on a stack that starts on the C stack; if it can't grow, a
+ * vector is freed by a nested call instead. */
+static void expr_destroy_vec(vec_expr_t args)
+{
+    vec_expr_t local[EXPR_STACK];
+    vec_expr_t *stack = local;
+    int n = 0, cap = EXPR_STACK;
+    stack[n++] = args;
+    while (n > 0) {
+        vec_expr_t v = stack[--n];
+        for (int i = 0; i < vec_len(&v); i++) {
+            vec_expr_t w = expr_unlink(&vec_nth(&v, i));
+            if (w.buf == NULL) {
+                continue;
+            }
+            if (n == cap && expr_stack_grow((void **)&stack, &cap, local,
+                                sizeof(*stack)) < 0) {
+                expr_destroy_vec(w);
+                continue;
+            }
+            stack[n++] = w;
+        }
+        vec_free(&v);
+    }
+    if (stack != local) {
+        free(stack);
+    }
+}
+
+static void expr_destroy_args(struct expr *e)
+{
+    vec_expr_t args = expr_unlink(e);
+    if (args.buf != NULL) {
+        expr_destroy_vec(args);
     }
 }
 
@@ -1084,5 +2058,3165 @@ void expr_destroy(struct expr *e, struct expr_var_list *vars)
             free(v);
             v = next;
         }
+        free(vars->table);
+        vars->head = NULL;
+        vars->table = NULL;
+        vars->cap = vars->len = 0;
+    }
+}
+
+/*
+ * Rebalancing. A chain of one associative operator, like a+b+c+d parsed as
+ * ((a+b)+c)+d, is regrouped into a balanced tree over the same operands in
+ * the same order, so that independent halves can be computed in parallel by
+ * the CPU. The argument vectors of the chain are reused for the new nodes.
+ * Operands are still evaluated left to right, but results can change once
+ * regrouped: float + and * round differently, and &, | and ^ go through a
+ * float after every step, losing bits past 2^24. This is why the pass only
+ * runs on request.
+ * Bodies of user-defined functions are shared by all call sites and are
+ * left as they are.
+ */
+typedef vec(struct expr *) vec_exprp_t;
+
+static int expr_is_chain(struct expr *e, int op)
+{
+    return e->type == op && vec_len(&e->param.op.args) == 2 &&
+           (op == OP_PLUS || op == OP_MULTIPLY || op == OP_BITWISE_AND ||
+               op == OP_BITWISE_OR || op == OP_BITWISE_XOR);
+}
+
+/* Builds a balanced tree over operands [lo, hi) into e, taking argument
+ * vectors from the end of vs */
+static void expr_balance(struct expr *e, int op, const struct expr *operands,
+    int lo, int hi, vec_expr_t *vs, int *nvs)
+{
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        e->type = op;
+        e->param.op.args = vs[--*nvs];
+        vec_len(&e->param.op.args) = 2;
+        expr_balance(
+            &vec_nth(&e->param.op.args, 0), op, operands, lo, mid, vs, nvs);
+        e = &vec_nth(&e->param.op.args, 1);
+        lo = mid;
+    }
+    *e = operands[lo];
+}
+
+/* Regroups the chain rooted at e, chain is scratch space for its operands.
+ * Returns -1 with e untouched if memory runs out */
+static int expr_rebalance_chain(struct expr *e, vec_exprp_t *chain)
+{
+    vec_exprp_t pending = vec_init();
+    vec_expr_t *vs = NULL;
+    struct expr *operands = NULL;
+    int op = e->type, n, nvs = 0, status = -1;
+
+    vec_len(chain) = 0;
+    if (vec_push(&pending, e) == -1) {
+        goto cleanup;
+    }
+    while (vec_len(&pending) > 0) {
+        struct expr *x = vec_pop(&pending);
+        if (!expr_is_chain(x, op)) {
+            if (vec_push(chain, x) == -1) {
+                goto cleanup;
+            }
+        } else if (vec_push(&pending, &vec_nth(&x->param.op.args, 1)) == -1) {
+            goto cleanup;
+        } else if (vec_push(&pending, &vec_nth(&x->param.op.args, 0)) == -1) {
+            goto cleanup;
+        }
+    }
+    n = vec_len(chain);
+    vs = (vec_expr_t *)malloc((n - 1) * sizeof(vec_expr_t));
+    operands = (struct expr *)malloc(n * sizeof(struct expr));
+    if (vs == NULL || operands == NULL) {
+        goto cleanup;
+    }
+    for (int i = 0; i < n; i++) {
+        operands[i] = *vec_nth(chain, i);
+    }
+    /* Operands are copied out, the vectors of the chain can be taken. The
+     * same walk again never needs more room on the stack */
+    vec_push(&pending, e);
+    while (vec_len(&pending) > 0) {
+        struct expr *x = vec_pop(&pending);
+        if (expr_is_chain(x, op)) {
+            vs[nvs++] = x->param.op.args;
+            vec_push(&pending, &vec_nth(&x->param.op.args, 1));
+            vec_push(&pending, &vec_nth(&x->param.op.args, 0));
+        }
+    }
+    expr_balance(e, op, operands, 0, n, vs, &nvs);
+    status = 0;
+cleanup:
+    vec_free(&pending);
+    free(vs);
+    free(operands);
+    return status;
+}
+
+struct expr_rebalance_node {
+    struct expr *e;
+    int parent; /* index of the parent, nodes are kept in pre-order */
+    int depth;
+};
+
+int expr_rebalance(struct expr *e)
+{
+    vec(struct expr_rebalance_node) nodes = vec_init();
+    vec_exprp_t chain = vec_init();
+    vec(int) pending = vec_init();
+    int depth = -1;
+
+    struct expr_rebalance_node root = {e, -1, 0};
+    if (vec_push(&nodes, root) == -1 || vec_push(&pending, 0) == -1) {
+        goto cleanup;
+    }
+    while (vec_len(&pending) > 0) {
+        int i = vec_pop(&pending);
+        struct expr *x = vec_nth(&nodes, i).e;
+        int parent = vec_nth(&nodes, i).parent;
+        vec_expr_t *args = NULL;
+        switch (x->type) {
+        case OP_CONST:
+        case OP_VAR:
+        case OP_ARG:
+            break;
+        case OP_FUNC:
+            args = &x->param.func.args;
+            break;
+        case OP_CALL:
+            args = &x->param.call.args;
+            break;
+        default:
+            /* Inner nodes of a chain were rebuilt with its root */
+            if (expr_is_chain(x, x->type) &&
+                (parent < 0 || !expr_is_chain(vec_nth(&nodes, parent).e,
+                                   x->type)) &&
+                expr_rebalance_chain(x, &chain) == -1) {
+                goto cleanup;
+            }
+            args = &x->param.op.args;
+            break;
+        }
+        for (int j = args ? vec_len(args) - 1 : -1; j >= 0; j--) {
+            struct expr_rebalance_node node = {&vec_nth(args, j), i, 0};
+            if (vec_push(&nodes, node) == -1 ||
+                vec_push(&pending, vec_len(&nodes) - 1) == -1) {
+                goto cleanup;
+            }
+        }
+    }
+    /* Children come after their parent, so they are done first */
+    for (int i = vec_len(&nodes) - 1; i > 0; i--) {
+        struct expr_rebalance_node *node = &vec_nth(&nodes, i);
+        struct expr_rebalance_node *parent = &vec_nth(&nodes, node->parent);
+        if (parent->depth < node->depth + 1) {
+            parent->depth = node->depth + 1;
+        }
+    }
+    depth = vec_nth(&nodes, 0).depth;
+cleanup:
+    vec_free(&nodes);
+    vec_free(&chain);
+    vec_free(&pending);
+    return depth;
+}
+
+/*
+ * Simplification. Identities like x*1, x-0 or -(-x) are removed and some
+ * operators are replaced by cheaper ones, bottom up, so that rewrites
+ * uncover others. Rules give the same results as the original expression,
+ * unless EXPR_SIMPLIFY_FAST_MATH allows those that may round differently or
+ * change the sign of a zero. powf() is only exact for the exponents 0 and 1,
+ * others, even x**2 and x**-1, are rewritten with fast math only. Bodies of
+ * $() functions are left as they are.
+ */
+#define EXPR_POWER_MAX 16 /* largest exponent turned into multiplications */
+
+/* Arguments of any node, NULL for leaves */
+static vec_expr_t *expr_children(struct expr *e)
+{
+    switch (e->type) {
+    case OP_CONST:
+    case OP_VAR:
+    case OP_ARG:
+        return NULL;
+    case OP_FUNC:
+        return &e->param.func.args;
+    case OP_CALL:
+        return &e->param.call.args;
+    default:
+        return &e->param.op.args;
+    }
+}
+
+static int expr_is_leaf(struct expr *e)
+{
+    return e->type == OP_CONST || e->type == OP_VAR || e->type == OP_ARG;
+}
+
+static int expr_is_const(struct expr *e, float value)
+{
+    return e->type == OP_CONST && e->param.num.value == value;
+}
+
+/* Values are always 0 or 1 */
+static int expr_is_boolean(struct expr *e)
+{
+    return (e->type >= OP_LT && e->type <= OP_NE) ||
+           e->type == OP_UNARY_LOGICAL_NOT;
+}
+
+/* Values are never -0, so adding 0 changes nothing */
+static int expr_is_signed_zero_free(struct expr *e)
+{
+    switch (e->type) {
+    case OP_CONST:
+        return e->param.num.value != 0 || !signbit(e->param.num.value);
+    case OP_UNARY_BITWISE_NOT:
+    case OP_SHL:
+    case OP_SHR:
+    case OP_BITWISE_AND:
+    case OP_BITWISE_OR:
+    case OP_BITWISE_XOR:
+    case OP_LOGICAL_AND:
+    case OP_LOGICAL_OR:
+    case OP_ABS:
+        return 1;
+    default:
+        return expr_is_boolean(e);
+    }
+}
+
+/* Replaces e by its argument i, the others must be leaves */
+static void expr_replace(struct expr_arena *arena, struct expr *e, int i)
+{
+    vec_expr_t args = e->param.op.args;
+    *e = vec_nth(&args, i);
+    expr_args_free(arena, &args);
+}
+
+/* Builds x*x*...*x, n times, as a balanced tree of copies of the leaf x */
+static int expr_product(
+    struct expr_arena *arena, struct expr x, int n, struct expr *result)
+{
+    struct expr a, b, e = expr_init();
+    if (n == 1) {
+        *result = x;
+        return 0;
+    }
+    if (expr_product(arena, x, n / 2, &a) == -1) {
+        return -1;
+    }
+    if (expr_product(arena, x, n - n / 2, &b) == -1) {
+        goto error;
+    }
+    e.type = OP_MULTIPLY;
+    if (expr_args_push(arena, &e.param.op.args, a) == -1 ||
+        expr_args_push(arena, &e.param.op.args, b) == -1) {
+        if (arena == NULL) {
+            expr_destroy_args(&b);
+        }
+        goto error;
+    }
+    *result = e;
+    return 0;
+error:
+    if (arena == NULL) {
+        expr_destroy_args(&a);
+        vec_free(&e.param.op.args);
+    }
+    return -1;
+}
+
+/* Rewrites x**c, returns 1 if it did, -1 if memory runs out */
+static int expr_simplify_power(
+    struct expr_arena *arena, struct expr *e, int flags)
+{
+    struct expr *x = &vec_nth(&e->param.op.args, 0);
+    struct expr *y = &vec_nth(&e->param.op.args, 1);
+    int fast = flags & EXPR_SIMPLIFY_FAST_MATH;
+    if (y->type != OP_CONST) {
+        return 0;
+    }
+    float c = y->param.num.value;
+    if (c == 1) {
+        expr_replace(arena, e, 0);
+    } else if (c == 0 && expr_is_leaf(x)) {
+        expr_args_free(arena, &e->param.op.args);
+        *e = expr_const(1); /* even for NaN */
+    } else if (c == 0.5f && fast) {
+        e->type = OP_SQRT;
+        vec_len(&e->param.op.args) = 1;
+    } else if (fast && expr_is_leaf(x) && fabsf(c) <= EXPR_POWER_MAX &&
+               c == (int)c) {
+        struct expr product;
+        if (expr_product(arena, *x, (int)fabsf(c), &product) == -1) {
+            return -1;
+        }
+        if (c > 0) {
+            expr_args_free(arena, &e->param.op.args);
+            *e = product;
+        } else {
+            e->type = OP_DIVIDE;
+            *x = expr_const(1);
+            *y = product;
+        }
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* Rewrites the node e, whose arguments are simplified already. Returns 1 if
+ * it did, -1 if memory runs out */
+static int expr_simplify_node(
+    struct expr_arena *arena, struct expr *e, int flags)
+{
+    int fast = flags & EXPR_SIMPLIFY_FAST_MATH;
+    struct expr *a, *b;
+    if (expr_is_leaf(e) || e->type == OP_FUNC || e->type == OP_CALL ||
+        expr_is_builtin(e->type)) {
+        return 0;
+    }
+    a = &vec_nth(&e->param.op.args, 0);
+    b = (expr_is_unary(e->type) ? NULL : &vec_nth(&e->param.op.args, 1));
+    switch (e->type) {
+    case OP_UNARY_MINUS:
+        if (a->type != OP_UNARY_MINUS) {
+            return 0;
+        }
+        expr_replace(arena, a, 0);
+        expr_replace(arena, e, 0);
+        return 1;
+    case OP_UNARY_LOGICAL_NOT:
+        if (a->type != OP_UNARY_LOGICAL_NOT ||
+            !expr_is_boolean(&vec_nth(&a->param.op.args, 0))) {
+            return 0;
+        }
+        expr_replace(arena, a, 0);
+        expr_replace(arena, e, 0);
+        return 1;
+    case OP_MULTIPLY:
+        if (expr_is_const(b, 1)) {
+            expr_replace(arena, e, 0);
+        } else if (expr_is_const(a, 1)) {
+            expr_replace(arena, e, 1);
+        } else {
+            return 0;
+        }
+        return 1;
+    case OP_DIVIDE:
+        if (expr_is_const(b, 1)) {
+            expr_replace(arena, e, 0);
+            return 1;
+        } else if (b->type == OP_CONST) {
+            /* Dividing by 2^k or multiplying by 2^-k rounds the same */
+            float c = b->param.num.value, r = 1 / c;
+            if (!fast && (!isfinite(r) || (double)r * c != 1)) {
+                return 0;
+            }
+            e->type = OP_MULTIPLY;
+            b->param.num.value = r;
+            return 1;
+        }
+        return 0;
+    case OP_PLUS:
+        if (expr_is_const(b, 0) &&
+            (fast || signbit(b->param.num.value) ||
+                expr_is_signed_zero_free(a))) {
+            expr_replace(arena, e, 0);
+        } else if (expr_is_const(a, 0) &&
+                   (fast || signbit(a->param.num.value) ||
+                       expr_is_signed_zero_free(b))) {
+            expr_replace(arena, e, 1);
+        } else {
+            return 0;
+        }
+        return 1;
+    case OP_MINUS:
+        if (!expr_is_const(b, 0) ||
+            (!fast && signbit(b->param.num.value) &&
+                !expr_is_signed_zero_free(a))) {
+            return 0;
+        }
+        expr_replace(arena, e, 0);
+        return 1;
+    case OP_POWER:
+        return expr_simplify_power(arena, e, flags);
+    default:
+        return 0;
+    }
+}
+
+int expr_simplify(struct expr_arena *arena, struct expr *e, int flags)
+{
+    vec_exprp_t nodes = vec_init();
+    int n = 0;
+    if (vec_push(&nodes, e) == -1) {
+        return -1;
+    }
+    /* Nodes breadth first, so children come after their parent */
+    for (int i = 0; i < vec_len(&nodes); i++) {
+        vec_expr_t *args = expr_children(vec_nth(&nodes, i));
+        for (int j = 0; args && j < vec_len(args); j++) {
+            if (vec_push(&nodes, &vec_nth(args, j)) == -1) {
+                vec_free(&nodes);
+                return -1;
+            }
+        }
+    }
+    for (int i = vec_len(&nodes) - 1; i >= 0 && n >= 0; i--) {
+        struct expr *x = vec_nth(&nodes, i);
+        int r;
+        while ((r = expr_simplify_node(arena, x, flags)) > 0) {
+            n++;
+        }
+        n = (r < 0 ? -1 : n);
+    }
+    vec_free(&nodes);
+    return n;
+}
+
+/*
+ * Expression cache. Every entry owns an arena holding its tree and the entry
+ * itself, which also keeps a copy of the root node: the pointer handed out
+ * leads back to the entry. Entries are chained in hash buckets and in a
+ * least recently used list, unreferenced ones are evicted from its tail.
+ */
+struct expr_cache_entry {
+    struct expr root;
+    struct expr_cache_entry *next; /* bucket chain */
+    struct expr_cache_entry *newer, *older;
+    struct expr_arena *arena;
+    struct expr_var_list *vars;
+    struct expr_func *funcs;
+    unsigned int hash;
+    int refs;
+    size_t bytes;
+    size_t len;
+    char s[];
+};
+
+struct expr_cache {
+    struct expr_cache_entry **buckets;
+    unsigned int nbuckets;
+    struct expr_cache_entry *newest, *oldest;
+    size_t budget;
+    struct expr_cache_stats stats;
+};
+
+struct expr_cache *expr_cache_create(size_t budget)
+{
+    struct expr_cache *c = calloc(1, sizeof(struct expr_cache));
+    if (c == NULL) {
+        return NULL;
+    }
+    c->nbuckets = 64;
+    c->buckets = calloc(c->nbuckets, sizeof(struct expr_cache_entry *));
+    if (c->buckets == NULL) {
+        free(c);
+        return NULL;
+    }
+    c->budget = budget;
+    return c;
+}
+
+static unsigned int expr_cache_hash(const char *s, size_t len,
+    struct expr_var_list *vars, struct expr_func *funcs)
+{
+    unsigned int h = expr_hash(s, len);
+    h = (h ^ (unsigned int)((uintptr_t)vars >> 4)) * 16777619u;
+    h = (h ^ (unsigned int)((uintptr_t)funcs >> 4)) * 16777619u;
+    return h;
+}
+
+static void expr_cache_unlink(
+    struct expr_cache *c, struct expr_cache_entry *en)
+{
+    if (en->newer) {
+        en->newer->older = en->older;
+    } else {
+        c->newest = en->older;
+    }
+    if (en->older) {
+        en->older->newer = en->newer;
+    } else {
+        c->oldest = en->newer;
+    }
+    en->newer = en->older = NULL;
+}
+
+static void expr_cache_push(struct expr_cache *c, struct expr_cache_entry *en)
+{
+    en->older = c->newest;
+    if (c->newest) {
+        c->newest->newer = en;
+    } else {
+        c->oldest = en;
+    }
+    c->newest = en;
+}
+
+static void expr_cache_touch(struct expr_cache *c, struct expr_cache_entry *en)
+{
+    expr_cache_unlink(c, en);
+    expr_cache_push(c, en);
+}
+
+static void expr_cache_evict(struct expr_cache *c, struct expr_cache_entry *en)
+{
+    struct expr_cache_entry **pp = &c->buckets[en->hash & (c->nbuckets - 1)];
+    while (*pp != en) {
+        pp = &(*pp)->next;
+    }
+    *pp = en->next;
+    expr_cache_unlink(c, en);
+    c->stats.entries--;
+    c->stats.bytes -= en->bytes;
+    expr_arena_destroy(en->arena); /* the entry lives in the arena */
+}
+
+static void expr_cache_trim(struct expr_cache *c)
+{
+    struct expr_cache_entry *en = c->oldest;
+    while (en && c->stats.bytes > c->budget) {
+        struct expr_cache_entry *newer = en->newer;
+        if (en->refs == 0) {
+            expr_cache_evict(c, en);
+            c->stats.evictions++;
+        }
+        en = newer;
+    }
+}
+
+static void expr_cache_grow(struct expr_cache *c)
+{
+    unsigned int n = c->nbuckets * 2;
+    struct expr_cache_entry **buckets
+        = calloc(n, sizeof(struct expr_cache_entry *));
+    if (buckets == NULL) {
+        return; /* longer chains, but still correct */
+    }
+    for (unsigned int i = 0; i < c->nbuckets; i++) {
+        for (struct expr_cache_entry *en = c->buckets[i], *next; en;
+             en = next) {
+            next = en->next;
+            en->next = buckets[en->hash & (n - 1)];
+            buckets[en->hash & (n - 1)] = en;
+        }
+    }
+    free(c->buckets);
+    c->buckets = buckets;
+    c->nbuckets = n;
+}
+
+struct expr *expr_cache_get(struct expr_cache *c, const char *s, size_t len,
+    struct expr_var_list *vars, struct expr_func *funcs)
+{
+    unsigned int hash = expr_cache_hash(s, len, vars, funcs);
+    struct expr_cache_entry *en = c->buckets[hash & (c->nbuckets - 1)];
+    for (; en; en = en->next) {
+        if (en->hash == hash && en->len == len && en->vars == vars
+            && en->funcs == funcs && memcmp(en->s, s, len) == 0) {
+            c->stats.hits++;
+            en->refs++;
+            expr_cache_touch(c, en);
+            return &en->root;
+        }
+    }
+    c->stats.misses++;
+
+    struct expr_arena *arena = expr_arena_create(256 + len * 16);
+    if (arena == NULL) {
+        return NULL;
+    }
+    struct expr *e = expr_create_in(arena, s, len, vars, funcs);
+    en = (e ? expr_arena_alloc(arena, sizeof(*en) + len + 1) : NULL);
+    if (en == NULL) {
+        expr_arena_destroy(arena);
+        return NULL;
+    }
+    en->root = *e;
+    en->arena = arena;
+    en->vars = vars;
+    en->funcs = funcs;
+    en->hash = hash;
+    en->refs = 1;
+    en->len = len;
+    memcpy(en->s, s, len);
+    en->bytes = sizeof(struct expr_arena);
+    for (struct expr_arena_block *b = arena->blocks; b; b = b->next) {
+        en->bytes += EXPR_ARENA_HEADER + b->size;
+    }
+
+    if (c->stats.entries >= c->nbuckets) {
+        expr_cache_grow(c);
+    }
+    en->next = c->buckets[hash & (c->nbuckets - 1)];
+    c->buckets[hash & (c->nbuckets - 1)] = en;
+    expr_cache_push(c, en);
+    c->stats.entries++;
+    c->stats.bytes += en->bytes;
+    expr_cache_trim(c);
+    return &en->root;
+}
+
+void expr_cache_release(struct expr_cache *c, struct expr *e)
+{
+    struct expr_cache_entry *en = (struct expr_cache_entry *)e;
+    if (--en->refs == 0) {
+        expr_cache_trim(c);
+    }
+}
+
+void expr_cache_get_stats(struct expr_cache *c, struct expr_cache_stats *st)
+{
+    *st = c->stats;
+}
+
+void expr_cache_destroy(struct expr_cache *c)
+{
+    if (c == NULL) {
+        return;
+    }
+    while (c->oldest) {
+        expr_cache_evict(c, c->oldest);
+    }
+    free(c->buckets);
+    free(c);
+}
+
+/*
+ * Compact expressions. The tree is copied into a single block of 16-byte
+ * nodes, children before their parents and referred to by index, followed
+ * by the tables the nodes index. Bodies of user-defined functions are copied
+ * once, custom functions are still called through their source node.
+ */
+struct expr_compactor {
+    vec(struct expr_node) nodes;
+    vec(int) args;
+    vec(struct expr *) funcs;
+    vec(struct expr_macro *) sources; /* macro of every entry of macros */
+    vec(struct expr_compact_macro) macros;
+    int error;
+};
+
+static int expr_compact_emit(
+    struct expr_compactor *k, int type, int a, int b, int c)
+{
+    struct expr_node n;
+    n.type = type;
+    n.a = a;
+    n.param.op.b = b;
+    n.param.op.c = c;
+    if (vec_push(&k->nodes, n) == -1) {
+        k->error = 1;
+        return -1;
+    }
+    return vec_len(&k->nodes) - 1;
+}
+
+static int expr_compact_copy(struct expr_compactor *k, struct expr *e);
+
+/* Copies the arguments of a call and returns where their list starts */
+static int expr_compact_list(struct expr_compactor *k, vec_expr_t *args)
+{
+    int n = vec_len(args);
+    int idx[n > 0 ? n : 1];
+    for (int i = 0; i < n; i++) {
+        idx[i] = expr_compact_copy(k, &vec_nth(args, i));
+    }
+    int start = vec_len(&k->args);
+    for (int i = 0; i < n; i++) {
+        if (vec_push(&k->args, idx[i]) == -1) {
+            k->error = 1;
+        }
+    }
+    return start;
+}
+
+/* Returns the index of the macro, copying its body the first time */
+static int expr_compact_macro(
+    struct expr_compactor *k, struct expr_macro *m)
+{
+    struct expr_compact_macro cm;
+    for (int i = 0; i < vec_len(&k->sources); i++) {
+        if (vec_nth(&k->sources, i) == m) {
+            return i;
+        }
+    }
+    cm.body = expr_compact_copy(k, &m->body);
+    cm.nparams = m->nparams;
+    if (vec_push(&k->sources, m) == -1) {
+        k->error = 1;
+        return -1;
+    }
+    if (vec_push(&k->macros, cm) == -1) {
+        k->error = 1;
+        return -1;
+    }
+    return vec_len(&k->macros) - 1;
+}
+
+static int expr_compact_copy(struct expr_compactor *k, struct expr *e)
+{
+    int n, a = -1, b = -1, c = -1;
+    if (k->error) {
+        return -1;
+    }
+    switch (e->type) {
+    case OP_CONST:
+        n = expr_compact_emit(k, OP_CONST, 0, 0, 0);
+        if (n >= 0) {
+            vec_nth(&k->nodes, n).param.value = e->param.num.value;
+        }
+        return n;
+    case OP_VAR:
+        n = expr_compact_emit(k, OP_VAR, 0, 0, 0);
+        if (n >= 0) {
+            vec_nth(&k->nodes, n).param.var = e->param.var.value;
+        }
+        return n;
+    case OP_ARG:
+        return expr_compact_emit(k, OP_ARG, e->param.arg.index, 0, 0);
+    case OP_FUNC:
+        /* Lazy functions are given their argument trees, which stay in the
+         * source expression */
+        if (e->param.func.f->f == NULL) {
+            b = expr_compact_list(k, &e->param.func.args);
+            c = vec_len(&e->param.func.args);
+        }
+        if (vec_push(&k->funcs, e) == -1) {
+            k->error = 1;
+            return -1;
+        }
+        return expr_compact_emit(k, OP_FUNC, vec_len(&k->funcs) - 1, b, c);
+    case OP_CALL:
+        b = expr_compact_list(k, &e->param.call.args);
+        a = expr_compact_macro(k, e->param.call.macro);
+        return expr_compact_emit(
+            k, OP_CALL, a, b, vec_len(&e->param.call.args));
+    case OP_UNKNOWN:
+        k->error = 1;
+        return -1;
+    default:
+        n = vec_len(&e->param.op.args);
+        if (n > 3) {
+            k->error = 1;
+            return -1;
+        }
+        a = n > 0 ? expr_compact_copy(k, &vec_nth(&e->param.op.args, 0)) : -1;
+        b = n > 1 ? expr_compact_copy(k, &vec_nth(&e->param.op.args, 1)) : -1;
+        c = n > 2 ? expr_compact_copy(k, &vec_nth(&e->param.op.args, 2)) : -1;
+        n = vec_len(&k->nodes);
+        return expr_compact_emit(k, e->type, n - a, n - b, n - c);
+    }
+}
+
+struct expr_compact *expr_compact(struct expr *e)
+{
+    struct expr_compactor k = { vec_init(), vec_init(), vec_init(),
+        vec_init(), vec_init(), 0 };
+    struct expr_compact *c = NULL;
+    expr_compact_copy(&k, e);
+
+    /* Pointer tables come first, to keep them aligned */
+    size_t funcs = sizeof(struct expr_compact);
+    size_t nodes = funcs + vec_len(&k.funcs) * sizeof(struct expr *);
+    size_t macros = nodes + vec_len(&k.nodes) * sizeof(struct expr_node);
+    size_t args =
+        macros + vec_len(&k.macros) * sizeof(struct expr_compact_macro);
+    size_t size = args + vec_len(&k.args) * sizeof(int);
+    if (!k.error) {
+        c = (struct expr_compact *)malloc(size);
+    }
+    if (c) {
+        char *base = (char *)c;
+        c->funcs = (struct expr **)(base + funcs);
+        c->nodes = (struct expr_node *)(base + nodes);
+        c->macros = (struct expr_compact_macro *)(base + macros);
+        c->args = (int *)(base + args);
+        c->len = vec_len(&k.nodes);
+        c->size = size;
+        /* The root is always there, other tables may be empty */
+        memcpy(c->nodes, k.nodes.buf,
+            vec_len(&k.nodes) * sizeof(*k.nodes.buf));
+        if (vec_len(&k.funcs) > 0) {
+            memcpy(c->funcs, k.funcs.buf,
+                vec_len(&k.funcs) * sizeof(*k.funcs.buf));
+        }
+        if (vec_len(&k.macros) > 0) {
+            memcpy(c->macros, k.macros.buf,
+                vec_len(&k.macros) * sizeof(*k.macros.buf));
+        }
+        if (vec_len(&k.args) > 0) {
+            memcpy(c->args, k.args.buf,
+                vec_len(&k.args) * sizeof(*k.args.buf));
+        }
+    }
+    vec_free(&k.nodes);
+    vec_free(&k.args);
+    vec_free(&k.funcs);
+    vec_free(&k.sources);
+    vec_free(&k.macros);
+    return c;
+}
+
+static float expr_compact_run(
+    const struct expr_compact *c, const struct expr_node *e);
+
+/* Calls are kept out of line, their frames would weigh on every node */
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+static float expr_compact_call(
+    const struct expr_compact *c, const struct expr_node *e)
+{
+    struct expr_compact_macro *m = &c->macros[e->a];
+    float frame[m->nparams > 0 ? m->nparams : 1];
+    for (int i = 0; i < e->param.op.c || i < m->nparams; i++) {
+        float v = (i < e->param.op.c
+                ? expr_compact_run(c, c->nodes + c->args[e->param.op.b + i])
+                : 0);
+        if (i < m->nparams) {
+            frame[i] = v;
+        }
+    }
+    float *caller = expr_frame;
+    expr_frame = frame;
+    float n = expr_compact_run(c, c->nodes + m->body);
+    expr_frame = caller;
+    return n;
+}
+
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+static float expr_compact_func(
+    const struct expr_compact *c, const struct expr_node *e)
+{
+    struct expr *src = c->funcs[e->a];
+    struct expr_func *f = src->param.func.f;
+    if (f->f) {
+        return f->f(f, src->param.func.args, src->param.func.context);
+    }
+    int n = e->param.op.c;
+    float args[n > 0 ? n : 1];
+    for (int k = 0; k < n; k++) {
+        args[k] = expr_compact_run(c, c->nodes + c->args[e->param.op.b + k]);
+    }
+    return f->native(f, args, n, src->param.func.context);
+}
+
+/* Same as expr_eval(), operand for operand */
+static float expr_compact_run(
+    const struct expr_compact *c, const struct expr_node *e)
+{
+    float n, a, b;
+    switch (e->type) {
+    case OP_UNARY_MINUS:
+        return -(expr_compact_run(c, e - e->a));
+    case OP_UNARY_LOGICAL_NOT:
+        return !(expr_compact_run(c, e - e->a));
+    case OP_UNARY_BITWISE_NOT:
+        return ~(to_int(expr_compact_run(c, e - e->a)));
+    case OP_POWER:
+        a = expr_compact_run(c, e - e->a);
+        return powf(a, expr_compact_run(c, e - e->param.op.b));
+    case OP_MULTIPLY:
+        a = expr_compact_run(c, e - e->a);
+        return a * expr_compact_run(c, e - e->param.op.b);
+    case OP_DIVIDE:
+        a = expr_compact_run(c, e - e->a);
+        return a / expr_compact_run(c, e - e->param.op.b);
+    case OP_REMAINDER:
+        a = expr_compact_run(c, e - e->a);
+        return fmodf(a, expr_compact_run(c, e - e->param.op.b));
+    case OP_PLUS:
+        a = expr_compact_run(c, e - e->a);
+        return a + expr_compact_run(c, e - e->param.op.b);
+    case OP_MINUS:
+        a = expr_compact_run(c, e - e->a);
+        return a - expr_compact_run(c, e - e->param.op.b);
+    case OP_SHL:
+        a = expr_compact_run(c, e - e->a);
+        return to_int(a) << to_int(expr_compact_run(c, e - e->param.op.b));
+    case OP_SHR:
+        a = expr_compact_run(c, e - e->a);
+        return to_int(a) >> to_int(expr_compact_run(c, e - e->param.op.b));
+    case OP_LT:
+        a = expr_compact_run(c, e - e->a);
+        return a < expr_compact_run(c, e - e->param.op.b);
+    case OP_LE:
+        a = expr_compact_run(c, e - e->a);
+        return a <= expr_compact_run(c, e - e->param.op.b);
+    case OP_GT:
+        a = expr_compact_run(c, e - e->a);
+        return a > expr_compact_run(c, e - e->param.op.b);
+    case OP_GE:
+        a = expr_compact_run(c, e - e->a);
+        return a >= expr_compact_run(c, e - e->param.op.b);
+    case OP_EQ:
+        a = expr_compact_run(c, e - e->a);
+        return a == expr_compact_run(c, e - e->param.op.b);
+    case OP_NE:
+        a = expr_compact_run(c, e - e->a);
+        return a != expr_compact_run(c, e - e->param.op.b);
+    case OP_BITWISE_AND:
+        a = expr_compact_run(c, e - e->a);
+        return to_int(a) & to_int(expr_compact_run(c, e - e->param.op.b));
+    case OP_BITWISE_OR:
+        a = expr_compact_run(c, e - e->a);
+        return to_int(a) | to_int(expr_compact_run(c, e - e->param.op.b));
+    case OP_BITWISE_XOR:
+        a = expr_compact_run(c, e - e->a);
+        return to_int(a) ^ to_int(expr_compact_run(c, e - e->param.op.b));
+    case OP_LOGICAL_AND:
+        n = expr_compact_run(c, e - e->a);
+        if (n != 0) {
+            n = expr_compact_run(c, e - e->param.op.b);
+            if (n != 0) {
+                return n;
+            }
+        }
+        return 0;
+    case OP_LOGICAL_OR:
+        n = expr_compact_run(c, e - e->a);
+        if (n != 0 && !isnan(n)) {
+            return n;
+        } else {
+            n = expr_compact_run(c, e - e->param.op.b);
+            if (n != 0) {
+                return n;
+            }
+        }
+        return 0;
+    case OP_ASSIGN:
+        n = expr_compact_run(c, e - e->param.op.b);
+        if ((e - e->a)->type == OP_VAR) {
+            *(e - e->a)->param.var = n;
+        } else if ((e - e->a)->type == OP_ARG) {
+            expr_frame[(e - e->a)->a] = n;
+        }
+        return n;
+    case OP_COMMA:
+        expr_compact_run(c, e - e->a);
+        return expr_compact_run(c, e - e->param.op.b);
+    case OP_CONST:
+        return e->param.value;
+    case OP_VAR:
+        return *e->param.var;
+    case OP_FUNC:
+        return expr_compact_func(c, e);
+    case OP_SQRT:
+        return sqrtf(expr_compact_run(c, e - e->a));
+    case OP_ABS:
+        return fabsf(expr_compact_run(c, e - e->a));
+    case OP_FLOOR:
+        return floorf(expr_compact_run(c, e - e->a));
+    case OP_CEIL:
+        return ceilf(expr_compact_run(c, e - e->a));
+    case OP_EXP:
+        return expf(expr_compact_run(c, e - e->a));
+    case OP_LOG:
+        return logf(expr_compact_run(c, e - e->a));
+    case OP_SIN:
+        return sinf(expr_compact_run(c, e - e->a));
+    case OP_COS:
+        return cosf(expr_compact_run(c, e - e->a));
+    case OP_MIN:
+        a = expr_compact_run(c, e - e->a);
+        return expr_min(a, expr_compact_run(c, e - e->param.op.b));
+    case OP_MAX:
+        a = expr_compact_run(c, e - e->a);
+        return expr_max(a, expr_compact_run(c, e - e->param.op.b));
+    case OP_CLAMP:
+        a = expr_compact_run(c, e - e->a);
+        b = expr_compact_run(c, e - e->param.op.b);
+        return expr_min(expr_max(a, b), expr_compact_run(c, e - e->param.op.c));
+    case OP_FMA:
+        a = expr_compact_run(c, e - e->a);
+        b = expr_compact_run(c, e - e->param.op.b);
+        return fmaf(a, b, expr_compact_run(c, e - e->param.op.c));
+    case OP_SELECT:
+        n = expr_compact_run(c, e - e->a);
+        a = expr_compact_run(c, e - e->param.op.b);
+        b = expr_compact_run(c, e - e->param.op.c);
+        return expr_select(n, a, b);
+    case OP_CALL:
+        return expr_compact_call(c, e);
+    case OP_ARG:
+        return expr_frame[e->a];
+    default:
+        return NAN;
+    }
+}
+
+float expr_compact_eval(struct expr_compact *c)
+{
+    return expr_compact_run(c, c->nodes + c->len - 1);
+}
+
+void expr_compact_destroy(struct expr_compact *c)
+{
+    free(c);
+}
+
+/*
+ * Compiled programs
+ */
+
+/*
+ * With GCC labels-as-values every instruction stores the address of its
+ * handler and each handler jumps straight to the next one, otherwise the
+ * loop falls back to a portable switch.
+ */
+#if defined(__GNUC__) && !defined(EXPR_NO_COMPUTED_GOTO)
+#define EXPR_THREADED 1
+#define VM_CASE(op) L_##op:
+#define VM_DISPATCH() goto *i->handler
+#define VM_DEFAULT() L_default:
+#else
+#define VM_CASE(op) case op:
+#define VM_DISPATCH() continue
+#define VM_DEFAULT() default:
+#endif
+/* Not wrapped into do-while, since "continue" must reach the dispatch loop */
+#define VM_NEXT()                                                             \
+    {                                                                         \
+        i++;                                                                  \
+        VM_DISPATCH();                                                        \
+    }
+#define VM_JUMP(target)                                                       \
+    {                                                                         \
+        i = code + (target);                                                  \
+        VM_DISPATCH();                                                        \
+    }
+
+/* Opcodes that only exist in compiled programs */
+enum expr_vm_op {
+    VM_JZ = OP_SELECT + 1, /* if (a == 0) dst = 0 and jump */
+    VM_JNZ,              /* if (a != 0 && !isnan(a)) dst = a and jump */
+    VM_MOV,
+    VM_RET,
+    VM_LOAD,  /* dst = slots[b] */
+    VM_STORE, /* slots[b] = dst = a */
+    VM_CALL,  /* dst = native function of b arguments, from a */
+};
+
+/*
+ * Common subexpression elimination numbers values while emitting code: an
+ * operator applied to the same operand registers is looked up in a hash
+ * table before emitting it again. Every value then gets its own register.
+ * Variable loads die when the variable is assigned or a lazy user function
+ * is called, and values computed on the right of && or || are forgotten
+ * after the jump target, because they may not have been computed at all.
+ * Native functions are never merged, they may keep state in their context.
+ */
+struct expr_cse_entry {
+    int op;
+    int reg;
+    uintptr_t a, b;
+    int t; /* third operand of fma() and select() */
+    int next; /* next entry in the same bucket, or -1 */
+    int dead;
+};
+
+struct expr_compiler {
+    int nslots;
+    vec_insn_t code;
+    int top;
+    int nregs;
+    int error;
+    int flags;
+    int eliminated;
+    vec(struct expr_cse_entry) cse;
+    int *buckets;
+    int nbuckets;
+    int frame; /* first argument register of the inlined call, or -1 */
+};
+
+static unsigned int expr_cse_hash(
+    struct expr_compiler *c, int op, uintptr_t a, uintptr_t b, int t)
+{
+    uint64_t h = ((uint64_t)op * 0x9e3779b97f4a7c15ull) ^ a;
+    h = (h * 0x9e3779b97f4a7c15ull) ^ b;
+    h = (h * 0x9e3779b97f4a7c15ull) ^ (uint32_t)t;
+    h = h * 0x9e3779b97f4a7c15ull;
+    return (unsigned int)(h >> 32) & (c->nbuckets - 1);
+}
+
+static int expr_cse_find(
+    struct expr_compiler *c, int op, uintptr_t a, uintptr_t b, int t)
+{
+    if (c->nbuckets == 0) {
+        return -1;
+    }
+    for (int k = c->buckets[expr_cse_hash(c, op, a, b, t)]; k >= 0;) {
+        struct expr_cse_entry *en = &vec_nth(&c->cse, k);
+        if (!en->dead && en->op == op && en->a == a && en->b == b
+            && en->t == t) {
+            c->eliminated++;
+            return en->reg;
+        }
+        k = en->next;
+    }
+    return -1;
+}
+
+static void expr_cse_add(
+    struct expr_compiler *c, int op, uintptr_t a, uintptr_t b, int t, int reg)
+{
+    if (vec_len(&c->cse) >= c->nbuckets) {
+        int n = c->nbuckets ? c->nbuckets * 2 : 64;
+        int *buckets = (int *)realloc(c->buckets, n * sizeof(int));
+        if (!buckets) {
+            c->error = 1;
+            return;
+        }
+        c->buckets = buckets;
+        c->nbuckets = n;
+        for (int k = 0; k < n; k++) {
+            c->buckets[k] = -1;
+        }
+        for (int k = 0; k < vec_len(&c->cse); k++) {
+            struct expr_cse_entry *en = &vec_nth(&c->cse, k);
+            unsigned int h = expr_cse_hash(c, en->op, en->a, en->b, en->t);
+            en->next = c->buckets[h];
+            c->buckets[h] = k;
+        }
+    }
+    unsigned int h = expr_cse_hash(c, op, a, b, t);
+    struct expr_cse_entry en = { op, reg, a, b, t, c->buckets[h], 0 };
+    if (vec_push(&c->cse, en) == -1) {
+        c->error = 1;
+        return;
+    }
+    c->buckets[h] = vec_len(&c->cse) - 1;
+}
+
+/* Forgets entries added since mark. Entries are removed in reverse order,
+ * so each of them is at the head of its bucket. */
+static void expr_cse_pop(struct expr_compiler *c, int mark)
+{
+    while (vec_len(&c->cse) > mark) {
+        struct expr_cse_entry en = vec_pop(&c->cse);
+        c->buckets[expr_cse_hash(c, en.op, en.a, en.b, en.t)] = en.next;
+    }
+}
+
+/* Forgets loads of a variable (OP_VAR) or argument register (VM_MOV), or
+ * of all variables and arguments if op is 0 */
+static void expr_cse_kill(struct expr_compiler *c, int op, uintptr_t a)
+{
+    for (int k = 0; k < vec_len(&c->cse); k++) {
+        struct expr_cse_entry *en = &vec_nth(&c->cse, k);
+        if (op == 0 ? (en->op == OP_VAR || en->op == VM_MOV)
+                    : (en->op == op && en->a == a)) {
+            en->dead = 1;
+        }
+    }
+}
+
+static int expr_compile_reg(struct expr_compiler *c)
+{
+    int r = c->top++;
+    if (c->top > c->nregs) {
+        c->nregs = c->top;
+    }
+    return r;
+}
+
+/* Registers of temporaries are reused, unless values are shared */
+static void expr_compile_release(struct expr_compiler *c, int base)
+{
+    if (!(c->flags & EXPR_COMPILE_CSE)) {
+        c->top = base;
+    }
+}
+
+static int expr_compile_emit(
+    struct expr_compiler *c, int op, int dst, int a, int b)
+{
+    struct expr_insn insn = { op, dst, a, b, { 0 }, NULL };
+    if (vec_push(&c->code, insn) == -1) {
+        c->error = 1;
+        return -1;
+    }
+    return vec_len(&c->code) - 1;
+}
+
+static void expr_compile_patch(struct expr_compiler *c, int jump)
+{
+    if (jump >= 0) {
+        vec_nth(&c->code, jump).b = vec_len(&c->code);
+    }
+}
+
+/* Variables of frame programs are numbered by their index in the list */
+static int expr_compile_slot(struct expr_compiler *c, float *var)
+{
+    int slot = ((struct expr_var *)var)->index;
+    if (slot >= c->nslots) {
+        c->nslots = slot + 1;
+    }
+    return slot;
+}
+
+/* Emits an instruction that only depends on its operands, or returns the
+ * register where the same value has already been computed. t is the third
+ * operand of fma() and select(). */
+static int expr_compile_pure3(struct expr_compiler *c, int op, uintptr_t a,
+    uintptr_t b, int t, int base)
+{
+    int cse = (c->flags & EXPR_COMPILE_CSE);
+    int dst = cse ? expr_cse_find(c, op, a, b, t) : -1;
+    if (dst >= 0) {
+        return dst;
+    }
+    expr_compile_release(c, base);
+    dst = expr_compile_reg(c);
+    int i = expr_compile_emit(c, op, dst, (int)a, (int)b);
+    if (i >= 0 && (op == OP_FMA || op == OP_SELECT)) {
+        vec_nth(&c->code, i).param.c = t;
+    } else if (i >= 0 && op == OP_CONST) {
+        memcpy(&vec_nth(&c->code, i).param.value, &a, sizeof(float));
+        vec_nth(&c->code, i).a = 0;
+    } else if (i >= 0 && op == OP_VAR) {
+        vec_nth(&c->code, i).param.var = (float *)a;
+        vec_nth(&c->code, i).a = 0;
+        if (c->flags & EXPR_COMPILE_FRAME) {
+            vec_nth(&c->code, i).op = VM_LOAD;
+            vec_nth(&c->code, i).b = expr_compile_slot(c, (float *)a);
+        }
+    }
+    if (cse) {
+        expr_cse_add(c, op, a, b, t, dst);
+    }
+    return dst;
+}
+
+static int expr_compile_pure(
+    struct expr_compiler *c, int op, uintptr_t a, uintptr_t b, int base)
+{
+    return expr_compile_pure3(c, op, a, b, 0, base);
+}
+
+static int expr_compile_node(struct expr_compiler *c, struct expr *e);
+
+/* Evaluates args into n consecutive registers and returns the first one.
+ * Missing arguments are zero, extra ones are evaluated and dropped. */
+static int expr_compile_frame(
+    struct expr_compiler *c, vec_expr_t *args, int n)
+{
+    int frame = c->top;
+    for (int k = 0; k < n; k++) {
+        expr_compile_reg(c);
+    }
+    int top = c->top;
+    for (int k = 0; k < vec_len(args) || k < n; k++) {
+        if (k >= vec_len(args)) {
+            expr_compile_emit(c, OP_CONST, frame + k, 0, 0);
+            continue;
+        }
+        int a = expr_compile_node(c, &vec_nth(args, k));
+        if (k < n) {
+            expr_compile_emit(c, VM_MOV, frame + k, a, 0);
+        }
+        expr_compile_release(c, top);
+    }
+    return frame;
+}
+
+/* Calls are inlined: the arguments are copied into consecutive registers,
+ * which the body then reads and assigns. Custom functions called from the
+ * body find them there too. */
+static int expr_compile_call(struct expr_compiler *c, struct expr *e)
+{
+    struct expr_macro *m = e->param.call.macro;
+    int frame = expr_compile_frame(c, &e->param.call.args, m->nparams);
+    int caller = c->frame;
+    c->frame = frame;
+    int r = expr_compile_node(c, &m->body);
+    c->frame = caller;
+    return r;
+}
+
+/* Emits code for e and returns the register that holds its value */
+static int expr_compile_node(struct expr_compiler *c, struct expr *e)
+{
+    int base = c->top;
+    int a, b, t, dst, j1, j2, i, mark;
+    uint32_t bits = 0;
+    float *var;
+    switch (e->type) {
+    case OP_CONST:
+        memcpy(&bits, &e->param.num.value, sizeof(bits));
+        return expr_compile_pure(c, OP_CONST, bits, 0, base);
+    case OP_VAR:
+        return expr_compile_pure(
+            c, OP_VAR, (uintptr_t)e->param.var.value, 0, base);
+    case OP_FUNC:
+        if (e->param.func.f->f == NULL) {
+            /* Native functions only see their arguments */
+            b = vec_len(&e->param.func.args);
+            a = expr_compile_frame(c, &e->param.func.args, b);
+            dst = expr_compile_reg(c);
+            i = expr_compile_emit(c, VM_CALL, dst, a, b);
+            if (i >= 0) {
+                vec_nth(&c->code, i).param.func = e;
+            }
+            return dst;
+        }
+        if (c->flags & EXPR_COMPILE_FRAME) {
+            c->error = 1; /* functions read variables behind our back */
+        }
+        dst = expr_compile_reg(c);
+        /* Arguments of the enclosing call are found at b */
+        i = expr_compile_emit(c, OP_FUNC, dst, 0, c->frame);
+        if (i >= 0) {
+            vec_nth(&c->code, i).param.func = e;
+        }
+        expr_cse_kill(c, 0, 0);
+        return dst;
+    case OP_CALL:
+        return expr_compile_call(c, e);
+    case OP_ARG:
+        return expr_compile_pure(
+            c, VM_MOV, c->frame + e->param.arg.index, 0, base);
+    case OP_ASSIGN:
+        a = expr_compile_node(c, &vec_nth(&e->param.op.args, 1));
+        if (vec_nth(&e->param.op.args, 0).type == OP_VAR) {
+            var = vec_nth(&e->param.op.args, 0).param.var.value;
+            if (c->flags & EXPR_COMPILE_FRAME) {
+                i = expr_compile_emit(
+                    c, VM_STORE, a, a, expr_compile_slot(c, var));
+            } else {
+                i = expr_compile_emit(c, OP_ASSIGN, a, a, 0);
+            }
+            if (i >= 0) {
+                vec_nth(&c->code, i).param.var = var;
+            }
+            if (c->flags & EXPR_COMPILE_CSE) {
+                /* The next load of the variable reads the assigned value */
+                expr_cse_kill(c, OP_VAR, (uintptr_t)var);
+                expr_cse_add(c, OP_VAR, (uintptr_t)var, 0, 0, a);
+            }
+        } else if (vec_nth(&e->param.op.args, 0).type == OP_ARG) {
+            dst = c->frame + vec_nth(&e->param.op.args, 0).param.arg.index;
+            expr_compile_emit(c, VM_MOV, dst, a, 0);
+            if (c->flags & EXPR_COMPILE_CSE) {
+                expr_cse_kill(c, VM_MOV, dst);
+                expr_cse_add(c, VM_MOV, dst, 0, 0, a);
+            }
+        }
+        return a;
+    case OP_COMMA:
+        expr_compile_node(c, &vec_nth(&e->param.op.args, 0));
+        expr_compile_release(c, base);
+        return expr_compile_node(c, &vec_nth(&e->param.op.args, 1));
+    case OP_LOGICAL_AND:
+    case OP_LOGICAL_OR:
+        a = expr_compile_node(c, &vec_nth(&e->param.op.args, 0));
+        dst = (c->flags & EXPR_COMPILE_CSE) ? expr_compile_reg(c) : a;
+        j1 = expr_compile_emit(
+            c, e->type == OP_LOGICAL_AND ? VM_JZ : VM_JNZ, dst, a, 0);
+        mark = vec_len(&c->cse);
+        expr_compile_release(c, base);
+        b = expr_compile_node(c, &vec_nth(&e->param.op.args, 1));
+        j2 = expr_compile_emit(c, VM_JZ, dst, b, 0);
+        if (b != dst) {
+            expr_compile_emit(c, VM_MOV, dst, b, 0);
+        }
+        expr_compile_patch(c, j1);
+        expr_compile_patch(c, j2);
+        expr_cse_pop(c, mark);
+        if (!(c->flags & EXPR_COMPILE_CSE)) {
+            c->top = dst + 1;
+        }
+        return dst;
+    case OP_CLAMP:
+        /* clamp(x, lo, hi) is min(max(x, lo), hi) */
+        a = expr_compile_node(c, &vec_nth(&e->param.op.args, 0));
+        b = expr_compile_node(c, &vec_nth(&e->param.op.args, 1));
+        t = expr_compile_node(c, &vec_nth(&e->param.op.args, 2));
+        a = expr_compile_pure(c, OP_MAX, a, b, c->top);
+        return expr_compile_pure(c, OP_MIN, a, t, base);
+    case OP_FMA:
+    case OP_SELECT:
+        a = expr_compile_node(c, &vec_nth(&e->param.op.args, 0));
+        b = expr_compile_node(c, &vec_nth(&e->param.op.args, 1));
+        t = expr_compile_node(c, &vec_nth(&e->param.op.args, 2));
+        return expr_compile_pure3(c, e->type, a, b, t, base);
+    default:
+        if (expr_is_unary(e->type) || expr_is_builtin(e->type)) {
+            a = expr_compile_node(c, &vec_nth(&e->param.op.args, 0));
+            b = 0;
+            if (vec_len(&e->param.op.args) > 1) {
+                b = expr_compile_node(c, &vec_nth(&e->param.op.args, 1));
+            }
+        } else if (expr_is_binary(e->type)) {
+            a = expr_compile_node(c, &vec_nth(&e->param.op.args, 0));
+            b = expr_compile_node(c, &vec_nth(&e->param.op.args, 1));
+        } else {
+            float nan = NAN;
+            memcpy(&bits, &nan, sizeof(bits));
+            return expr_compile_pure(c, OP_CONST, bits, 0, base);
+        }
+        return expr_compile_pure(c, e->type, a, b, base);
+    }
+}
+
+static float expr_vm_run(struct expr_program *p, float *r, float *slots,
+    const void *const **handlers);
+
+struct expr_program *expr_compile(struct expr *e)
+{
+    return expr_compile_ex(e, 0);
+}
+
+struct expr_program *expr_compile_ex(struct expr *e, int flags)
+{
+    struct expr_compiler c = { 0, vec_init(), 0, 0, 0, flags, 0,
+        vec_init(), NULL, 0, -1 };
+    int r = expr_compile_node(&c, e);
+    expr_compile_emit(&c, VM_RET, 0, r, 0);
+
+    struct expr_program *p = NULL;
+    if (!c.error) {
+        p = (struct expr_program *)calloc(1, sizeof(struct expr_program));
+    }
+    if (p) {
+#ifdef EXPR_THREADED
+        const void *const *handlers;
+        expr_vm_run(NULL, NULL, NULL, &handlers);
+        for (int i = 0; i < vec_len(&c.code); i++) {
+            vec_nth(&c.code, i).handler = handlers[vec_nth(&c.code, i).op];
+        }
+#endif
+        p->code = c.code;
+        p->flags = flags;
+        p->nregs = c.nregs;
+        /* Frames hold the registers too, after the variables */
+        p->nslots = c.nslots + ((flags & EXPR_COMPILE_FRAME) ? c.nregs : 0);
+        p->eliminated = c.eliminated;
+        p->regs = (float *)calloc(c.nregs > 0 ? c.nregs : 1, sizeof(float));
+        if (!p->regs) {
+            free(p);
+            p = NULL;
+        }
+    }
+    if (!p) {
+        vec_free(&c.code);
+    }
+    vec_free(&c.cse);
+    free(c.buckets);
+    return p;
+}
+
+/* When handlers is not NULL the handler table is returned instead of running
+ * p. Label addresses are only valid within one copy of the function, hence
+ * noinline and noclone, which Clang doesn't know and doesn't need. */
+#if defined(EXPR_THREADED) && defined(__clang__)
+__attribute__((noinline))
+#elif defined(EXPR_THREADED)
+__attribute__((noinline, noclone))
+#endif
+static float expr_vm_run(struct expr_program *p, float *r, float *slots,
+    const void *const **handlers)
+{
+#ifdef EXPR_THREADED
+    static const void *const labels[] = {
+        [OP_UNKNOWN] = &&L_default,
+        [OP_UNARY_MINUS] = &&L_OP_UNARY_MINUS,
+        [OP_UNARY_LOGICAL_NOT] = &&L_OP_UNARY_LOGICAL_NOT,
+        [OP_UNARY_BITWISE_NOT] = &&L_OP_UNARY_BITWISE_NOT,
+        [OP_POWER] = &&L_OP_POWER,
+        [OP_DIVIDE] = &&L_OP_DIVIDE,
+        [OP_MULTIPLY] = &&L_OP_MULTIPLY,
+        [OP_REMAINDER] = &&L_OP_REMAINDER,
+        [OP_PLUS] = &&L_OP_PLUS,
+        [OP_MINUS] = &&L_OP_MINUS,
+        [OP_SHL] = &&L_OP_SHL,
+        [OP_SHR] = &&L_OP_SHR,
+        [OP_LT] = &&L_OP_LT,
+        [OP_LE] = &&L_OP_LE,
+        [OP_GT] = &&L_OP_GT,
+        [OP_GE] = &&L_OP_GE,
+        [OP_EQ] = &&L_OP_EQ,
+        [OP_NE] = &&L_OP_NE,
+        [OP_BITWISE_AND] = &&L_OP_BITWISE_AND,
+        [OP_BITWISE_OR] = &&L_OP_BITWISE_OR,
+        [OP_BITWISE_XOR] = &&L_OP_BITWISE_XOR,
+        [OP_LOGICAL_AND] = &&L_default,
+        [OP_LOGICAL_OR] = &&L_default,
+        [OP_ASSIGN] = &&L_OP_ASSIGN,
+        [OP_COMMA] = &&L_default,
+        [OP_CONST] = &&L_OP_CONST,
+        [OP_VAR] = &&L_OP_VAR,
+        [OP_FUNC] = &&L_OP_FUNC,
+        [OP_CALL] = &&L_default,
+        [OP_ARG] = &&L_default,
+        [OP_SQRT] = &&L_OP_SQRT,
+        [OP_ABS] = &&L_OP_ABS,
+        [OP_FLOOR] = &&L_OP_FLOOR,
+        [OP_CEIL] = &&L_OP_CEIL,
+        [OP_EXP] = &&L_OP_EXP,
+        [OP_LOG] = &&L_OP_LOG,
+        [OP_SIN] = &&L_OP_SIN,
+        [OP_COS] = &&L_OP_COS,
+        [OP_MIN] = &&L_OP_MIN,
+        [OP_MAX] = &&L_OP_MAX,
+        [OP_CLAMP] = &&L_default,
+        [OP_FMA] = &&L_OP_FMA,
+        [OP_SELECT] = &&L_OP_SELECT,
+        [VM_JZ] = &&L_VM_JZ,
+        [VM_JNZ] = &&L_VM_JNZ,
+        [VM_MOV] = &&L_VM_MOV,
+        [VM_RET] = &&L_VM_RET,
+        [VM_LOAD] = &&L_VM_LOAD,
+        [VM_STORE] = &&L_VM_STORE,
+        [VM_CALL] = &&L_VM_CALL,
+    };
+    if (handlers) {
+        *handlers = labels;
+        return 0;
+    }
+#else
+    (void)handlers;
+#endif
+    struct expr_insn *code = p->code.buf;
+    struct expr_insn *i = code;
+    struct expr *f;
+#ifdef EXPR_THREADED
+    VM_DISPATCH();
+#else
+    for (;;) {
+        switch (i->op) {
+#endif
+    VM_CASE(OP_UNARY_MINUS)
+        r[i->dst] = -r[i->a];
+        VM_NEXT();
+    VM_CASE(OP_UNARY_LOGICAL_NOT)
+        r[i->dst] = !r[i->a];
+        VM_NEXT();
+    VM_CASE(OP_UNARY_BITWISE_NOT)
+        r[i->dst] = ~to_int(r[i->a]);
+        VM_NEXT();
+    VM_CASE(OP_POWER)
+        r[i->dst] = powf(r[i->a], r[i->b]);
+        VM_NEXT();
+    VM_CASE(OP_MULTIPLY)
+        r[i->dst] = r[i->a] * r[i->b];
+        VM_NEXT();
+    VM_CASE(OP_DIVIDE)
+        r[i->dst] = r[i->a] / r[i->b];
+        VM_NEXT();
+    VM_CASE(OP_REMAINDER)
+        r[i->dst] = fmodf(r[i->a], r[i->b]);
+        VM_NEXT();
+    VM_CASE(OP_PLUS)
+        r[i->dst] = r[i->a] + r[i->b];
+        VM_NEXT();
+    VM_CASE(OP_MINUS)
+        r[i->dst] = r[i->a] - r[i->b];
+        VM_NEXT();
+    VM_CASE(OP_SHL)
+        r[i->dst] = to_int(r[i->a]) << to_int(r[i->b]);
+        VM_NEXT();
+    VM_CASE(OP_SHR)
+        r[i->dst] = to_int(r[i->a]) >> to_int(r[i->b]);
+        VM_NEXT();
+    VM_CASE(OP_LT)
+        r[i->dst] = r[i->a] < r[i->b];
+        VM_NEXT();
+    VM_CASE(OP_LE)
+        r[i->dst] = r[i->a] <= r[i->b];
+        VM_NEXT();
+    VM_CASE(OP_GT)
+        r[i->dst] = r[i->a] > r[i->b];
+        VM_NEXT();
+    VM_CASE(OP_GE)
+        r[i->dst] = r[i->a] >= r[i->b];
+        VM_NEXT();
+    VM_CASE(OP_EQ)
+        r[i->dst] = r[i->a] == r[i->b];
+        VM_NEXT();
+    VM_CASE(OP_NE)
+        r[i->dst] = r[i->a] != r[i->b];
+        VM_NEXT();
+    VM_CASE(OP_BITWISE_AND)
+        r[i->dst] = to_int(r[i->a]) & to_int(r[i->b]);
+        VM_NEXT();
+    VM_CASE(OP_BITWISE_OR)
+        r[i->dst] = to_int(r[i->a]) | to_int(r[i->b]);
+        VM_NEXT();
+    VM_CASE(OP_BITWISE_XOR)
+        r[i->dst] = to_int(r[i->a]) ^ to_int(r[i->b]);
+        VM_NEXT();
+    VM_CASE(OP_ASSIGN)
+        *i->param.var = r[i->a];
+        r[i->dst] = r[i->a];
+        VM_NEXT();
+    VM_CASE(OP_CONST)
+        r[i->dst] = i->param.value;
+        VM_NEXT();
+    VM_CASE(OP_VAR)
+        r[i->dst] = *i->param.var;
+        VM_NEXT();
+    VM_CASE(OP_FUNC)
+        f = i->param.func;
+        if (i->b >= 0) {
+            float *caller = expr_frame;
+            expr_frame = r + i->b;
+            r[i->dst] = f->param.func.f->f(
+                f->param.func.f, f->param.func.args, f->param.func.context);
+            expr_frame = caller;
+        } else {
+            r[i->dst] = f->param.func.f->f(
+                f->param.func.f, f->param.func.args, f->param.func.context);
+        }
+        VM_NEXT();
+    VM_CASE(OP_SQRT)
+        r[i->dst] = sqrtf(r[i->a]);
+        VM_NEXT();
+    VM_CASE(OP_ABS)
+        r[i->dst] = fabsf(r[i->a]);
+        VM_NEXT();
+    VM_CASE(OP_FLOOR)
+        r[i->dst] = floorf(r[i->a]);
+        VM_NEXT();
+    VM_CASE(OP_CEIL)
+        r[i->dst] = ceilf(r[i->a]);
+        VM_NEXT();
+    VM_CASE(OP_EXP)
+        r[i->dst] = expf(r[i->a]);
+        VM_NEXT();
+    VM_CASE(OP_LOG)
+        r[i->dst] = logf(r[i->a]);
+        VM_NEXT();
+    VM_CASE(OP_SIN)
+        r[i->dst] = sinf(r[i->a]);
+        VM_NEXT();
+    VM_CASE(OP_COS)
+        r[i->dst] = cosf(r[i->a]);
+        VM_NEXT();
+    VM_CASE(OP_MIN)
+        r[i->dst] = expr_min(r[i->a], r[i->b]);
+        VM_NEXT();
+    VM_CASE(OP_MAX)
+        r[i->dst] = expr_max(r[i->a], r[i->b]);
+        VM_NEXT();
+    VM_CASE(OP_FMA)
+        r[i->dst] = fmaf(r[i->a], r[i->b], r[i->param.c]);
+        VM_NEXT();
+    VM_CASE(OP_SELECT)
+        r[i->dst] = expr_select(r[i->a], r[i->b], r[i->param.c]);
+        VM_NEXT();
+    VM_CASE(VM_JZ)
+        if (r[i->a] == 0) {
+            r[i->dst] = 0;
+            VM_JUMP(i->b);
+        }
+        VM_NEXT();
+    VM_CASE(VM_JNZ)
+        if (r[i->a] != 0 && !isnan(r[i->a])) {
+            r[i->dst] = r[i->a];
+            VM_JUMP(i->b);
+        }
+        VM_NEXT();
+    VM_CASE(VM_MOV)
+        r[i->dst] = r[i->a];
+        VM_NEXT();
+    VM_CASE(VM_LOAD)
+        r[i->dst] = slots[i->b];
+        VM_NEXT();
+    VM_CASE(VM_STORE)
+        slots[i->b] = r[i->a];
+        r[i->dst] = r[i->a];
+        VM_NEXT();
+    VM_CASE(VM_CALL)
+        f = i->param.func;
+        r[i->dst] = f->param.func.f->native(
+            f->param.func.f, r + i->a, i->b, f->param.func.context);
+        VM_NEXT();
+    VM_CASE(VM_RET)
+        return r[i->a];
+    VM_DEFAULT()
+        return NAN;
+#ifndef EXPR_THREADED
+        }
+    }
+#endif
+}
+
+float expr_program_eval(struct expr_program *p)
+{
+    if (p->flags & EXPR_COMPILE_FRAME) {
+        return NAN;
+    }
+    return expr_vm_run(p, p->regs, NULL, NULL);
+}
+
+/* Nothing is written to the program, registers live on the stack */
+float expr_program_eval_frame(struct expr_program *p, float *slots)
+{
+    return expr_vm_run(p, slots + p->nslots - p->nregs, slots, NULL);
+}
+
+void expr_program_destroy(struct expr_program *p)
+{
+    if (p) {
+#ifdef EXPR_JIT
+        if (p->jit) {
+            munmap(p->jit, p->jitsz);
+        }
+#endif
+        vec_free(&p->code);
+        free(p->regs);
+        free(p);
+    }
+}
+
+/*
+ * x86-64 JIT. Program registers live in the stack frame at [rbp-4*(r+1)]
+ * and every instruction is translated into a few SSE scalar instructions.
+ * Operations without a native counterpart call back into C.
+ */
+#ifdef EXPR_JIT
+typedef vec(unsigned char) vec_byte_t;
+
+struct expr_jit_fixup {
+    int at;     /* offset of the rel32 field */
+    int target; /* instruction index */
+};
+
+struct expr_jit {
+    vec_byte_t code;
+    vec(struct expr_jit_fixup) fixups;
+    int error;
+};
+
+static void expr_jit_emit(struct expr_jit *j, const void *bytes, int n)
+{
+    for (int k = 0; k < n; k++) {
+        if (vec_push(&j->code, ((const unsigned char *)bytes)[k]) == -1) {
+            j->error = 1;
+            return;
+        }
+    }
+}
+
+#define expr_jit_bytes(j, ...)                                                \
+    do {                                                                      \
+        const unsigned char b[] = { __VA_ARGS__ };                            \
+        expr_jit_emit(j, b, sizeof(b));                                       \
+    } while (0)
+
+static void expr_jit_u32(struct expr_jit *j, uint32_t v)
+{
+    unsigned char b[4] = { v, v >> 8, v >> 16, v >> 24 };
+    expr_jit_emit(j, b, 4);
+}
+
+static void expr_jit_u64(struct expr_jit *j, uint64_t v)
+{
+    expr_jit_u32(j, (uint32_t)v);
+    expr_jit_u32(j, (uint32_t)(v >> 32));
+}
+
+/* F3 0F op with xmm and [rbp-4*(r+1)] operands, e.g. movss/addss/cmpss */
+static void expr_jit_ss(struct expr_jit *j, int op, int xmm, int r)
+{
+    expr_jit_bytes(j, 0xf3, 0x0f, op, 0x85 | (xmm << 3));
+    expr_jit_u32(j, (uint32_t)(-4 * (r + 1)));
+}
+
+static void expr_jit_load(struct expr_jit *j, int xmm, int r)
+{
+    expr_jit_ss(j, 0x10, xmm, r);
+}
+
+static void expr_jit_store(struct expr_jit *j, int xmm, int r)
+{
+    expr_jit_ss(j, 0x11, xmm, r);
+}
+
+/* mov eax, bits; movd xmm1, eax; andps/xorps xmm0, xmm1 */
+static void expr_jit_mask(struct expr_jit *j, int op, uint32_t bits)
+{
+    expr_jit_bytes(j, 0xb8);
+    expr_jit_u32(j, bits);
+    expr_jit_bytes(j, 0x66, 0x0f, 0x6e, 0xc8, 0x0f, op, 0xc1);
+}
+
+static void expr_jit_call(struct expr_jit *j, void (*fn)(void))
+{
+    expr_jit_bytes(j, 0x48, 0xb8); /* mov rax, fn */
+    expr_jit_u64(j, (uint64_t)(uintptr_t)fn);
+    expr_jit_bytes(j, 0xff, 0xd0); /* call rax */
+}
+
+static void expr_jit_jump(struct expr_jit *j, int target)
+{
+    expr_jit_bytes(j, 0xe9);
+    struct expr_jit_fixup fix = { vec_len(&j->code), target };
+    if (vec_push(&j->fixups, fix) == -1) {
+        j->error = 1;
+    }
+    expr_jit_u32(j, 0);
+}
+
+static float expr_jit_bitwise_not(float a)
+{
+    return ~to_int(a);
+}
+
+static float expr_jit_shl(float a, float b)
+{
+    return to_int(a) << to_int(b);
+}
+
+static float expr_jit_shr(float a, float b)
+{
+    return to_int(a) >> to_int(b);
+}
+
+static float expr_jit_bitwise_and(float a, float b)
+{
+    return to_int(a) & to_int(b);
+}
+
+static float expr_jit_bitwise_or(float a, float b)
+{
+    return to_int(a) | to_int(b);
+}
+
+static float expr_jit_bitwise_xor(float a, float b)
+{
+    return to_int(a) ^ to_int(b);
+}
+
+static float expr_jit_func(struct expr *f)
+{
+    return f->param.func.f->f(
+        f->param.func.f, f->param.func.args, f->param.func.context);
+}
+
+/* Registers are laid out downwards, regs points to the last argument */
+static float expr_jit_native(struct expr *f, const float *regs)
+{
+    int n = vec_len(&f->param.func.args);
+    float args[n > 0 ? n : 1];
+    for (int k = 0; k < n; k++) {
+        args[k] = regs[n - 1 - k];
+    }
+    return f->param.func.f->native(
+        f->param.func.f, args, n, f->param.func.context);
+}
+
+static int expr_jit_insn(struct expr_jit *j, struct expr_insn *i)
+{
+    void (*helper)(void) = NULL;
+    uint32_t bits;
+    switch (i->op) {
+    case OP_CONST: /* mov dword [rbp+disp], imm32 */
+        memcpy(&bits, &i->param.value, sizeof(bits));
+        expr_jit_bytes(j, 0xc7, 0x85);
+        expr_jit_u32(j, (uint32_t)(-4 * (i->dst + 1)));
+        expr_jit_u32(j, bits);
+        return 0;
+    case OP_VAR: /* mov rax, var; movss xmm0, [rax] */
+        expr_jit_bytes(j, 0x48, 0xb8);
+        expr_jit_u64(j, (uint64_t)(uintptr_t)i->param.var);
+        expr_jit_bytes(j, 0xf3, 0x0f, 0x10, 0x00);
+        expr_jit_store(j, 0, i->dst);
+        return 0;
+    case OP_ASSIGN: /* mov rax, var; movss [rax], xmm0 */
+        expr_jit_load(j, 0, i->a);
+        expr_jit_bytes(j, 0x48, 0xb8);
+        expr_jit_u64(j, (uint64_t)(uintptr_t)i->param.var);
+        expr_jit_bytes(j, 0xf3, 0x0f, 0x11, 0x00);
+        expr_jit_store(j, 0, i->dst);
+        return 0;
+    case OP_FUNC: /* mov rdi, node */
+        if (i->b >= 0) {
+            return -1; /* arguments of calls are not contiguous here */
+        }
+        expr_jit_bytes(j, 0x48, 0xbf);
+        expr_jit_u64(j, (uint64_t)(uintptr_t)i->param.func);
+        expr_jit_call(j, (void (*)(void))expr_jit_func);
+        expr_jit_store(j, 0, i->dst);
+        return 0;
+    case VM_CALL: /* lea rsi, [rbp+disp]; mov rdi, node */
+        expr_jit_bytes(j, 0x48, 0x8d, 0xb5);
+        expr_jit_u32(j, (uint32_t)(-4 * (i->a + i->b)));
+        expr_jit_bytes(j, 0x48, 0xbf);
+        expr_jit_u64(j, (uint64_t)(uintptr_t)i->param.func);
+        expr_jit_call(j, (void (*)(void))expr_jit_native);
+        expr_jit_store(j, 0, i->dst);
+        return 0;
+    case VM_MOV:
+        expr_jit_load(j, 0, i->a);
+        expr_jit_store(j, 0, i->dst);
+        return 0;
+    case OP_UNARY_MINUS:
+        expr_jit_load(j, 0, i->a);
+        expr_jit_mask(j, 0x57, 0x80000000);
+        expr_jit_store(j, 0, i->dst);
+        return 0;
+    case OP_UNARY_LOGICAL_NOT: /* xorps xmm1, xmm1; cmpeqss xmm0, xmm1 */
+        expr_jit_load(j, 0, i->a);
+        expr_jit_bytes(j, 0x0f, 0x57, 0xc9, 0xf3, 0x0f, 0xc2, 0xc1, 0);
+        expr_jit_mask(j, 0x54, 0x3f800000);
+        expr_jit_store(j, 0, i->dst);
+        return 0;
+    case OP_PLUS:
+    case OP_MINUS:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+        expr_jit_load(j, 0, i->a);
+        expr_jit_ss(j,
+            i->op == OP_PLUS ? 0x58 : i->op == OP_MINUS ? 0x5c
+                : i->op == OP_MULTIPLY ? 0x59 : 0x5e,
+            0, i->b);
+        expr_jit_store(j, 0, i->dst);
+        return 0;
+    case OP_LT:
+    case OP_LE:
+    case OP_GT:
+    case OP_GE:
+    case OP_EQ:
+    case OP_NE:
+        /* cmpss predicates: eq=0, lt=1, le=2, neq=4, a>b is b<a */
+        if (i->op == OP_GT || i->op == OP_GE) {
+            expr_jit_load(j, 0, i->b);
+            expr_jit_ss(j, 0xc2, 0, i->a);
+            expr_jit_bytes(j, i->op == OP_GT ? 1 : 2);
+        } else {
+            expr_jit_load(j, 0, i->a);
+            expr_jit_ss(j, 0xc2, 0, i->b);
+            expr_jit_bytes(j, i->op == OP_LT ? 1 : i->op == OP_LE ? 2
+                    : i->op == OP_EQ ? 0 : 4);
+        }
+        expr_jit_mask(j, 0x54, 0x3f800000);
+        expr_jit_store(j, 0, i->dst);
+        return 0;
+    case VM_JZ:
+        /* xorps xmm1, xmm1; ucomiss xmm0, xmm1; jp skip; jne skip;
+           movss [dst], xmm1; jmp target; skip: */
+        expr_jit_load(j, 0, i->a);
+        expr_jit_bytes(j, 0x0f, 0x57, 0xc9, 0x0f, 0x2e, 0xc1, 0x7a, 15, 0x75,
+            13);
+        expr_jit_store(j, 1, i->dst);
+        expr_jit_jump(j, i->b);
+        return 0;
+    case VM_JNZ:
+        /* same as above, but jumps away when a != 0 and a is not NaN */
+        expr_jit_load(j, 0, i->a);
+        expr_jit_bytes(j, 0x0f, 0x57, 0xc9, 0x0f, 0x2e, 0xc1, 0x7a, 15, 0x74,
+            13);
+        expr_jit_store(j, 0, i->dst);
+        expr_jit_jump(j, i->b);
+        return 0;
+    case VM_RET: /* leave; ret */
+        expr_jit_load(j, 0, i->a);
+        expr_jit_bytes(j, 0xc9, 0xc3);
+        return 0;
+    case OP_UNARY_BITWISE_NOT:
+        expr_jit_load(j, 0, i->a);
+        expr_jit_call(j, (void (*)(void))expr_jit_bitwise_not);
+        expr_jit_store(j, 0, i->dst);
+        return 0;
+    case OP_SQRT: /* sqrtss xmm0, [a] */
+        expr_jit_ss(j, 0x51, 0, i->a);
+        expr_jit_store(j, 0, i->dst);
+        return 0;
+    case OP_ABS:
+        expr_jit_load(j, 0, i->a);
+        expr_jit_mask(j, 0x54, 0x7fffffff);
+        expr_jit_store(j, 0, i->dst);
+        return 0;
+    case OP_FLOOR:
+        helper = (void (*)(void))floorf;
+        break;
+    case OP_CEIL:
+        helper = (void (*)(void))ceilf;
+        break;
+    case OP_EXP:
+        helper = (void (*)(void))expf;
+        break;
+    case OP_LOG:
+        helper = (void (*)(void))logf;
+        break;
+    case OP_SIN:
+        helper = (void (*)(void))sinf;
+        break;
+    case OP_COS:
+        helper = (void (*)(void))cosf;
+        break;
+    case OP_MIN:
+        helper = (void (*)(void))expr_min;
+        break;
+    case OP_MAX:
+        helper = (void (*)(void))expr_max;
+        break;
+    case OP_FMA:
+        helper = (void (*)(void))fmaf;
+        break;
+    case OP_SELECT:
+        helper = (void (*)(void))expr_select;
+        break;
+    case OP_POWER:
+        helper = (void (*)(void))powf;
+        break;
+    case OP_REMAINDER:
+        helper = (void (*)(void))fmodf;
+        break;
+    case OP_SHL:
+        helper = (void (*)(void))expr_jit_shl;
+        break;
+    case OP_SHR:
+        helper = (void (*)(void))expr_jit_shr;
+        break;
+    case OP_BITWISE_AND:
+        helper = (void (*)(void))expr_jit_bitwise_and;
+        break;
+    case OP_BITWISE_OR:
+        helper = (void (*)(void))expr_jit_bitwise_or;
+        break;
+    case OP_BITWISE_XOR:
+        helper = (void (*)(void))expr_jit_bitwise_xor;
+        break;
+    default:
+        return -1;
+    }
+    expr_jit_load(j, 0, i->a);
+    expr_jit_load(j, 1, i->b);
+    if (i->op == OP_FMA || i->op == OP_SELECT) {
+        expr_jit_load(j, 2, i->param.c);
+    }
+    expr_jit_call(j, helper);
+    expr_jit_store(j, 0, i->dst);
+    return 0;
+}
+#endif
+
+expr_jit_t expr_program_jit(struct expr_program *p)
+{
+#ifdef EXPR_JIT
+    if (p->jit || (p->flags & EXPR_COMPILE_FRAME)) {
+        return (expr_jit_t)p->jit;
+    }
+    struct expr_jit j = { vec_init(), vec_init(), 0 };
+    int n = vec_len(&p->code);
+    int *offsets = (int *)calloc(n, sizeof(int));
+    if (!offsets) {
+        return NULL;
+    }
+    /* push rbp; mov rbp, rsp; sub rsp, frame */
+    expr_jit_bytes(&j, 0x55, 0x48, 0x89, 0xe5, 0x48, 0x81, 0xec);
+    expr_jit_u32(&j, (uint32_t)((4 * p->nregs + 15) & ~15));
+    for (int k = 0; k < n && !j.error; k++) {
+        offsets[k] = vec_len(&j.code);
+        if (expr_jit_insn(&j, &vec_nth(&p->code, k)) == -1) {
+            j.error = 1;
+        }
+    }
+    void *mem = MAP_FAILED;
+    size_t size = vec_len(&j.code);
+    if (!j.error) {
+        struct expr_jit_fixup fix;
+        int k;
+        vec_foreach(&j.fixups, fix, k)
+        {
+            uint32_t rel = (uint32_t)(offsets[fix.target] - (fix.at + 4));
+            memcpy(&vec_nth(&j.code, fix.at), &rel, sizeof(rel));
+        }
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (mem != MAP_FAILED) {
+        memcpy(mem, j.code.buf, size);
+        if (mprotect(mem, size, PROT_READ | PROT_EXEC) == 0) {
+            p->jit = mem;
+            p->jitsz = size;
+        } else {
+            munmap(mem, size);
+        }
+    }
+    free(offsets);
+    vec_free(&j.code);
+    vec_free(&j.fixups);
+    return (expr_jit_t)p->jit;
+#else
+    (void)p;
+    return NULL;
+#endif
+}
+
+/*
+ * Batch evaluation. The program runs over blocks of rows, so that every
+ * instruction is dispatched once per block and handled by a tight loop over
+ * the lanes. Jumps of && and || are taken per lane: lanes that jump keep
+ * their value aside and get it back at the jump target.
+ */
+#define EXPR_BATCH_SIZE 128
+
+typedef void (*expr_kernel_t)(
+    float *d, const float *a, const float *b, const float *c, int n);
+
+#define EXPR_KERNEL(name, value)                                              \
+    static void expr_kernel_##name(                                           \
+        float *d, const float *a, const float *b, const float *c, int n)      \
+    {                                                                         \
+        (void)b, (void)c;                                                     \
+        for (int k = 0; k < n; k++) {                                         \
+            d[k] = (value);                                                   \
+        }                                                                     \
+    }
+
+EXPR_KERNEL(unary_minus, -a[k])
+EXPR_KERNEL(unary_logical_not, !a[k])
+EXPR_KERNEL(unary_bitwise_not, ~to_int(a[k]))
+EXPR_KERNEL(power, powf(a[k], b[k]))
+EXPR_KERNEL(multiply, a[k] * b[k])
+EXPR_KERNEL(divide, a[k] / b[k])
+EXPR_KERNEL(remainder, fmodf(a[k], b[k]))
+EXPR_KERNEL(plus, a[k] + b[k])
+EXPR_KERNEL(minus, a[k] - b[k])
+EXPR_KERNEL(shl, to_int(a[k]) << to_int(b[k]))
+EXPR_KERNEL(shr, to_int(a[k]) >> to_int(b[k]))
+EXPR_KERNEL(lt, a[k] < b[k])
+EXPR_KERNEL(le, a[k] <= b[k])
+EXPR_KERNEL(gt, a[k] > b[k])
+EXPR_KERNEL(ge, a[k] >= b[k])
+EXPR_KERNEL(eq, a[k] == b[k])
+EXPR_KERNEL(ne, a[k] != b[k])
+EXPR_KERNEL(bitwise_and, to_int(a[k]) & to_int(b[k]))
+EXPR_KERNEL(bitwise_or, to_int(a[k]) | to_int(b[k]))
+EXPR_KERNEL(bitwise_xor, to_int(a[k]) ^ to_int(b[k]))
+EXPR_KERNEL(sqrt, sqrtf(a[k]))
+EXPR_KERNEL(abs, fabsf(a[k]))
+EXPR_KERNEL(floor, floorf(a[k]))
+EXPR_KERNEL(ceil, ceilf(a[k]))
+EXPR_KERNEL(exp, expf(a[k]))
+EXPR_KERNEL(log, logf(a[k]))
+EXPR_KERNEL(sin, sinf(a[k]))
+EXPR_KERNEL(cos, cosf(a[k]))
+EXPR_KERNEL(min, expr_min(a[k], b[k]))
+EXPR_KERNEL(max, expr_max(a[k], b[k]))
+EXPR_KERNEL(fma, fmaf(a[k], b[k], c[k]))
+EXPR_KERNEL(select, expr_select(a[k], b[k], c[k]))
+
+/* Jump tests fill the lane mask and the values of lanes that jump, and
+ * return the number of such lanes */
+static int expr_kernel_jz(uint32_t *mask, float *saved, const float *a, int n)
+{
+    int taken = 0;
+    for (int k = 0; k < n; k++) {
+        mask[k] = (a[k] == 0) ? ~0u : 0;
+        saved[k] = 0;
+        taken += (a[k] == 0);
+    }
+    return taken;
+}
+
+static int expr_kernel_jnz(
+    uint32_t *mask, float *saved, const float *a, int n)
+{
+    int taken = 0;
+    for (int k = 0; k < n; k++) {
+        int t = (a[k] != 0 && !isnan(a[k]));
+        mask[k] = t ? ~0u : 0;
+        saved[k] = a[k];
+        taken += t;
+    }
+    return taken;
+}
+
+static void expr_kernel_blend(
+    float *d, const uint32_t *mask, const float *saved, int n)
+{
+    for (int k = 0; k < n; k++) {
+        d[k] = mask[k] ? saved[k] : d[k];
+    }
+}
+
+struct expr_kernels {
+    expr_kernel_t ops[OP_SELECT + 1];
+    int (*jz)(uint32_t *mask, float *saved, const float *a, int n);
+    int (*jnz)(uint32_t *mask, float *saved, const float *a, int n);
+    void (*blend)(float *d, const uint32_t *mask, const float *saved, int n);
+};
+
+static const struct expr_kernels expr_scalar_kernels = {
+    {
+        [OP_UNARY_MINUS] = expr_kernel_unary_minus,
+        [OP_UNARY_LOGICAL_NOT] = expr_kernel_unary_logical_not,
+        [OP_UNARY_BITWISE_NOT] = expr_kernel_unary_bitwise_not,
+        [OP_POWER] = expr_kernel_power,
+        [OP_DIVIDE] = expr_kernel_divide,
+        [OP_MULTIPLY] = expr_kernel_multiply,
+        [OP_REMAINDER] = expr_kernel_remainder,
+        [OP_PLUS] = expr_kernel_plus,
+        [OP_MINUS] = expr_kernel_minus,
+        [OP_SHL] = expr_kernel_shl,
+        [OP_SHR] = expr_kernel_shr,
+        [OP_LT] = expr_kernel_lt,
+        [OP_LE] = expr_kernel_le,
+        [OP_GT] = expr_kernel_gt,
+        [OP_GE] = expr_kernel_ge,
+        [OP_EQ] = expr_kernel_eq,
+        [OP_NE] = expr_kernel_ne,
+        [OP_BITWISE_AND] = expr_kernel_bitwise_and,
+        [OP_BITWISE_OR] = expr_kernel_bitwise_or,
+        [OP_BITWISE_XOR] = expr_kernel_bitwise_xor,
+        [OP_SQRT] = expr_kernel_sqrt,
+        [OP_ABS] = expr_kernel_abs,
+        [OP_FLOOR] = expr_kernel_floor,
+        [OP_CEIL] = expr_kernel_ceil,
+        [OP_EXP] = expr_kernel_exp,
+        [OP_LOG] = expr_kernel_log,
+        [OP_SIN] = expr_kernel_sin,
+        [OP_COS] = expr_kernel_cos,
+        [OP_MIN] = expr_kernel_min,
+        [OP_MAX] = expr_kernel_max,
+        [OP_FMA] = expr_kernel_fma,
+        [OP_SELECT] = expr_kernel_select,
+    },
+    expr_kernel_jz,
+    expr_kernel_jnz,
+    expr_kernel_blend,
+};
+
+/*
+ * AVX2 and AVX-512 kernels, selected at run time. Integer operators convert
+ * lanes with the same rules as to_int(), and shift counts are masked like
+ * the scalar shift instructions do, so all kernels agree with the scalar
+ * ones bit for bit. powf, fmodf and the transcendental functions have no
+ * vector form in libm and stay scalar, and so does fmaf without AVX-512.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(EXPR_NO_SIMD)
+#define EXPR_SIMD 1
+
+#define EXPR_AVX2 __attribute__((target("avx2")))
+#define EXPR_AVX512 __attribute__((target("avx512f")))
+
+EXPR_AVX2 static inline __m256i expr_to_int_avx2(__m256 x)
+{
+    __m256i i = _mm256_cvttps_epi32(x);
+    __m256 nan = _mm256_cmp_ps(x, x, _CMP_UNORD_Q);
+    __m256 pinf = _mm256_cmp_ps(x, _mm256_set1_ps(INFINITY), _CMP_EQ_OQ);
+    __m256 ninf = _mm256_cmp_ps(x, _mm256_set1_ps(-INFINITY), _CMP_EQ_OQ);
+    i = _mm256_andnot_si256(_mm256_castps_si256(nan), i);
+    i = _mm256_blendv_epi8(
+        i, _mm256_set1_epi32(INT_MAX), _mm256_castps_si256(pinf));
+    return _mm256_blendv_epi8(
+        i, _mm256_set1_epi32(-INT_MAX), _mm256_castps_si256(ninf));
+}
+
+EXPR_AVX512 static inline __m512i expr_to_int_avx512(__m512 x)
+{
+    __m512i i = _mm512_cvttps_epi32(x);
+    i = _mm512_mask_mov_epi32(i, _mm512_cmp_ps_mask(x, x, _CMP_UNORD_Q),
+        _mm512_setzero_si512());
+    i = _mm512_mask_mov_epi32(i,
+        _mm512_cmp_ps_mask(x, _mm512_set1_ps(INFINITY), _CMP_EQ_OQ),
+        _mm512_set1_epi32(INT_MAX));
+    return _mm512_mask_mov_epi32(i,
+        _mm512_cmp_ps_mask(x, _mm512_set1_ps(-INFINITY), _CMP_EQ_OQ),
+        _mm512_set1_epi32(-INT_MAX));
+}
+
+/* minps and maxps return the second operand when either is NaN or both are
+ * zero, the equal and unordered lanes are fixed up as expr_min() does */
+EXPR_AVX2 static inline __m256 expr_min_avx2(__m256 a, __m256 b)
+{
+    __m256 r = _mm256_min_ps(a, b);
+    r = _mm256_blendv_ps(
+        r, _mm256_or_ps(a, b), _mm256_cmp_ps(a, b, _CMP_EQ_OQ));
+    return _mm256_blendv_ps(r, a, _mm256_cmp_ps(b, b, _CMP_UNORD_Q));
+}
+
+EXPR_AVX2 static inline __m256 expr_max_avx2(__m256 a, __m256 b)
+{
+    __m256 r = _mm256_max_ps(a, b);
+    r = _mm256_blendv_ps(
+        r, _mm256_and_ps(a, b), _mm256_cmp_ps(a, b, _CMP_EQ_OQ));
+    return _mm256_blendv_ps(r, a, _mm256_cmp_ps(b, b, _CMP_UNORD_Q));
+}
+
+EXPR_AVX512 static inline __m512 expr_min_avx512(__m512 a, __m512 b)
+{
+    __m512 r = _mm512_min_ps(a, b);
+    r = _mm512_mask_mov_ps(r, _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ),
+        _mm512_castsi512_ps(_mm512_or_si512(
+            _mm512_castps_si512(a), _mm512_castps_si512(b))));
+    return _mm512_mask_mov_ps(r, _mm512_cmp_ps_mask(b, b, _CMP_UNORD_Q), a);
+}
+
+EXPR_AVX512 static inline __m512 expr_max_avx512(__m512 a, __m512 b)
+{
+    __m512 r = _mm512_max_ps(a, b);
+    r = _mm512_mask_mov_ps(r, _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ),
+        _mm512_castsi512_ps(_mm512_and_si512(
+            _mm512_castps_si512(a), _mm512_castps_si512(b))));
+    return _mm512_mask_mov_ps(r, _mm512_cmp_ps_mask(b, b, _CMP_UNORD_Q), a);
+}
+
+#define EXPR_AVX2_KERNEL(name, value)                                         \
+    EXPR_AVX2 static void expr_avx2_##name(                                   \
+        float *d, const float *a, const float *b, const float *c, int n)      \
+    {                                                                         \
+        const __m256 one = _mm256_set1_ps(1);                                 \
+        const __m256i bits = _mm256_set1_epi32(31);                           \
+        (void)one, (void)bits;                                                \
+        int k = 0;                                                            \
+        for (; k + 8 <= n; k += 8) {                                          \
+            __m256 va = _mm256_loadu_ps(a + k);                               \
+            __m256 vb = _mm256_loadu_ps(b + k);                               \
+            __m256 vc = _mm256_loadu_ps(c + k);                               \
+            (void)va, (void)vb, (void)vc;                                     \
+            _mm256_storeu_ps(d + k, (value));                                 \
+        }                                                                     \
+        expr_kernel_##name(d + k, a + k, b + k, c + k, n - k);                \
+    }
+
+#define EXPR_AVX2_CMP(name, pred)                                             \
+    EXPR_AVX2_KERNEL(name, _mm256_and_ps(_mm256_cmp_ps(va, vb, pred), one))
+#define EXPR_AVX2_INT(name, op)                                               \
+    EXPR_AVX2_KERNEL(name,                                                    \
+        _mm256_cvtepi32_ps(op(expr_to_int_avx2(va), expr_to_int_avx2(vb))))
+#define EXPR_AVX2_SHIFT(name, op)                                             \
+    EXPR_AVX2_KERNEL(name,                                                    \
+        _mm256_cvtepi32_ps(op(expr_to_int_avx2(va),                           \
+            _mm256_and_si256(expr_to_int_avx2(vb), bits))))
+
+EXPR_AVX2_KERNEL(unary_minus, _mm256_xor_ps(va, _mm256_set1_ps(-0.0f)))
+EXPR_AVX2_KERNEL(unary_logical_not,
+    _mm256_and_ps(_mm256_cmp_ps(va, _mm256_setzero_ps(), _CMP_EQ_OQ), one))
+EXPR_AVX2_KERNEL(unary_bitwise_not,
+    _mm256_cvtepi32_ps(_mm256_xor_si256(
+        expr_to_int_avx2(va), _mm256_set1_epi32(-1))))
+EXPR_AVX2_KERNEL(multiply, _mm256_mul_ps(va, vb))
+EXPR_AVX2_KERNEL(divide, _mm256_div_ps(va, vb))
+EXPR_AVX2_KERNEL(plus, _mm256_add_ps(va, vb))
+EXPR_AVX2_KERNEL(minus, _mm256_sub_ps(va, vb))
+EXPR_AVX2_SHIFT(shl, _mm256_sllv_epi32)
+EXPR_AVX2_SHIFT(shr, _mm256_srav_epi32)
+EXPR_AVX2_CMP(lt, _CMP_LT_OQ)
+EXPR_AVX2_CMP(le, _CMP_LE_OQ)
+EXPR_AVX2_CMP(gt, _CMP_GT_OQ)
+EXPR_AVX2_CMP(ge, _CMP_GE_OQ)
+EXPR_AVX2_CMP(eq, _CMP_EQ_OQ)
+EXPR_AVX2_CMP(ne, _CMP_NEQ_UQ)
+EXPR_AVX2_INT(bitwise_and, _mm256_and_si256)
+EXPR_AVX2_INT(bitwise_or, _mm256_or_si256)
+EXPR_AVX2_INT(bitwise_xor, _mm256_xor_si256)
+EXPR_AVX2_KERNEL(sqrt, _mm256_sqrt_ps(va))
+EXPR_AVX2_KERNEL(abs, _mm256_andnot_ps(_mm256_set1_ps(-0.0f), va))
+EXPR_AVX2_KERNEL(floor, _mm256_floor_ps(va))
+EXPR_AVX2_KERNEL(ceil, _mm256_ceil_ps(va))
+EXPR_AVX2_KERNEL(min, expr_min_avx2(va, vb))
+EXPR_AVX2_KERNEL(max, expr_max_avx2(va, vb))
+EXPR_AVX2_KERNEL(select,
+    _mm256_blendv_ps(
+        vc, vb, _mm256_cmp_ps(va, _mm256_setzero_ps(), _CMP_NEQ_UQ)))
+
+EXPR_AVX2 static int expr_avx2_jz(
+    uint32_t *mask, float *saved, const float *a, int n)
+{
+    int taken = 0;
+    int k = 0;
+    for (; k + 8 <= n; k += 8) {
+        __m256 m = _mm256_cmp_ps(
+            _mm256_loadu_ps(a + k), _mm256_setzero_ps(), _CMP_EQ_OQ);
+        _mm256_storeu_si256((__m256i *)(mask + k), _mm256_castps_si256(m));
+        _mm256_storeu_ps(saved + k, _mm256_setzero_ps());
+        taken += __builtin_popcount(_mm256_movemask_ps(m));
+    }
+    return taken + expr_kernel_jz(mask + k, saved + k, a + k, n - k);
+}
+
+EXPR_AVX2 static int expr_avx2_jnz(
+    uint32_t *mask, float *saved, const float *a, int n)
+{
+    int taken = 0;
+    int k = 0;
+    for (; k + 8 <= n; k += 8) {
+        __m256 va = _mm256_loadu_ps(a + k);
+        __m256 m = _mm256_cmp_ps(va, _mm256_setzero_ps(), _CMP_NEQ_OQ);
+        _mm256_storeu_si256((__m256i *)(mask + k), _mm256_castps_si256(m));
+        _mm256_storeu_ps(saved + k, va);
+        taken += __builtin_popcount(_mm256_movemask_ps(m));
+    }
+    return taken + expr_kernel_jnz(mask + k, saved + k, a + k, n - k);
+}
+
+EXPR_AVX2 static void expr_avx2_blend(
+    float *d, const uint32_t *mask, const float *saved, int n)
+{
+    int k = 0;
+    for (; k + 8 <= n; k += 8) {
+        __m256 m = _mm256_castsi256_ps(
+            _mm256_loadu_si256((const __m256i *)(mask + k)));
+        _mm256_storeu_ps(d + k, _mm256_blendv_ps(_mm256_loadu_ps(d + k),
+                                    _mm256_loadu_ps(saved + k), m));
+    }
+    expr_kernel_blend(d + k, mask + k, saved + k, n - k);
+}
+
+#define EXPR_AVX512_KERNEL(name, value)                                       \
+    EXPR_AVX512 static void expr_avx512_##name(                               \
+        float *d, const float *a, const float *b, const float *c, int n)      \
+    {                                                                         \
+        const __m512 one = _mm512_set1_ps(1);                                 \
+        const __m512i bits = _mm512_set1_epi32(31);                           \
+        (void)one, (void)bits;                                                \
+        int k = 0;                                                            \
+        for (; k + 16 <= n; k += 16) {                                        \
+            __m512 va = _mm512_loadu_ps(a + k);                               \
+            __m512 vb = _mm512_loadu_ps(b + k);                               \
+            __m512 vc = _mm512_loadu_ps(c + k);                               \
+            (void)va, (void)vb, (void)vc;                                     \
+            _mm512_storeu_ps(d + k, (value));                                 \
+        }                                                                     \
+        expr_kernel_##name(d + k, a + k, b + k, c + k, n - k);                \
+    }
+
+#define EXPR_AVX512_CMP(name, pred)                                           \
+    EXPR_AVX512_KERNEL(                                                       \
+        name, _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(va, vb, pred), one))
+#define EXPR_AVX512_INT(name, op)                                             \
+    EXPR_AVX512_KERNEL(name,                                                  \
+        _mm512_cvtepi32_ps(                                                   \
+            op(expr_to_int_avx512(va), expr_to_int_avx512(vb))))
+#define EXPR_AVX512_SHIFT(name, op)                                           \
+    EXPR_AVX512_KERNEL(name,                                                  \
+        _mm512_cvtepi32_ps(op(expr_to_int_avx512(va),                         \
+            _mm512_and_si512(expr_to_int_avx512(vb), bits))))
+
+EXPR_AVX512_KERNEL(unary_minus,
+    _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(va),
+        _mm512_set1_epi32((int)0x80000000))))
+EXPR_AVX512_KERNEL(unary_logical_not,
+    _mm512_maskz_mov_ps(
+        _mm512_cmp_ps_mask(va, _mm512_setzero_ps(), _CMP_EQ_OQ), one))
+EXPR_AVX512_KERNEL(unary_bitwise_not,
+    _mm512_cvtepi32_ps(_mm512_xor_si512(
+        expr_to_int_avx512(va), _mm512_set1_epi32(-1))))
+EXPR_AVX512_KERNEL(multiply, _mm512_mul_ps(va, vb))
+EXPR_AVX512_KERNEL(divide, _mm512_div_ps(va, vb))
+EXPR_AVX512_KERNEL(plus, _mm512_add_ps(va, vb))
+EXPR_AVX512_KERNEL(minus, _mm512_sub_ps(va, vb))
+EXPR_AVX512_SHIFT(shl, _mm512_sllv_epi32)
+EXPR_AVX512_SHIFT(shr, _mm512_srav_epi32)
+EXPR_AVX512_CMP(lt, _CMP_LT_OQ)
+EXPR_AVX512_CMP(le, _CMP_LE_OQ)
+EXPR_AVX512_CMP(gt, _CMP_GT_OQ)
+EXPR_AVX512_CMP(ge, _CMP_GE_OQ)
+EXPR_AVX512_CMP(eq, _CMP_EQ_OQ)
+EXPR_AVX512_CMP(ne, _CMP_NEQ_UQ)
+EXPR_AVX512_INT(bitwise_and, _mm512_and_si512)
+EXPR_AVX512_INT(bitwise_or, _mm512_or_si512)
+EXPR_AVX512_INT(bitwise_xor, _mm512_xor_si512)
+EXPR_AVX512_KERNEL(sqrt, _mm512_sqrt_ps(va))
+EXPR_AVX512_KERNEL(abs,
+    _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(va),
+        _mm512_set1_epi32(0x7fffffff))))
+EXPR_AVX512_KERNEL(floor,
+    _mm512_roundscale_ps(va, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC))
+EXPR_AVX512_KERNEL(ceil,
+    _mm512_roundscale_ps(va, _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC))
+EXPR_AVX512_KERNEL(min, expr_min_avx512(va, vb))
+EXPR_AVX512_KERNEL(max, expr_max_avx512(va, vb))
+EXPR_AVX512_KERNEL(fma, _mm512_fmadd_ps(va, vb, vc))
+EXPR_AVX512_KERNEL(select,
+    _mm512_mask_mov_ps(vc,
+        _mm512_cmp_ps_mask(va, _mm512_setzero_ps(), _CMP_NEQ_UQ), vb))
+
+EXPR_AVX512 static int expr_avx512_jz(
+    uint32_t *mask, float *saved, const float *a, int n)
+{
+    int taken = 0;
+    int k = 0;
+    for (; k + 16 <= n; k += 16) {
+        __mmask16 m = _mm512_cmp_ps_mask(
+            _mm512_loadu_ps(a + k), _mm512_setzero_ps(), _CMP_EQ_OQ);
+        _mm512_storeu_si512(mask + k, _mm512_maskz_mov_epi32(m,
+                                          _mm512_set1_epi32(-1)));
+        _mm512_storeu_ps(saved + k, _mm512_setzero_ps());
+        taken += __builtin_popcount(m);
+    }
+    return taken + expr_kernel_jz(mask + k, saved + k, a + k, n - k);
+}
+
+EXPR_AVX512 static int expr_avx512_jnz(
+    uint32_t *mask, float *saved, const float *a, int n)
+{
+    int taken = 0;
+    int k = 0;
+    for (; k + 16 <= n; k += 16) {
+        __m512 va = _mm512_loadu_ps(a + k);
+        __mmask16 m
+            = _mm512_cmp_ps_mask(va, _mm512_setzero_ps(), _CMP_NEQ_OQ);
+        _mm512_storeu_si512(mask + k, _mm512_maskz_mov_epi32(m,
+                                          _mm512_set1_epi32(-1)));
+        _mm512_storeu_ps(saved + k, va);
+        taken += __builtin_popcount(m);
+    }
+    return taken + expr_kernel_jnz(mask + k, saved + k, a + k, n - k);
+}
+
+EXPR_AVX512 static void expr_avx512_blend(
+    float *d, const uint32_t *mask, const float *saved, int n)
+{
+    int k = 0;
+    for (; k + 16 <= n; k += 16) {
+        __mmask16 m = _mm512_test_epi32_mask(
+            _mm512_loadu_si512(mask + k), _mm512_set1_epi32(-1));
+        _mm512_storeu_ps(d + k, _mm512_mask_mov_ps(_mm512_loadu_ps(d + k), m,
+                                    _mm512_loadu_ps(saved + k)));
+    }
+    expr_kernel_blend(d + k, mask + k, saved + k, n - k);
+}
+
+#define EXPR_SIMD_KERNELS(isa)                                                \
+    {                                                                         \
+        {                                                                     \
+            [OP_UNARY_MINUS] = expr_##isa##_unary_minus,                      \
+            [OP_UNARY_LOGICAL_NOT] = expr_##isa##_unary_logical_not,          \
+            [OP_UNARY_BITWISE_NOT] = expr_##isa##_unary_bitwise_not,          \
+            [OP_POWER] = expr_kernel_power,                                   \
+            [OP_DIVIDE] = expr_##isa##_divide,                                \
+            [OP_MULTIPLY] = expr_##isa##_multiply,                            \
+            [OP_REMAINDER] = expr_kernel_remainder,                           \
+            [OP_PLUS] = expr_##isa##_plus,                                    \
+            [OP_MINUS] = expr_##isa##_minus,                                  \
+            [OP_SHL] = expr_##isa##_shl,                                      \
+            [OP_SHR] = expr_##isa##_shr,                                      \
+            [OP_LT] = expr_##isa##_lt,                                        \
+            [OP_LE] = expr_##isa##_le,                                        \
+            [OP_GT] = expr_##isa##_gt,                                        \
+            [OP_GE] = expr_##isa##_ge,                                        \
+            [OP_EQ] = expr_##isa##_eq,                                        \
+            [OP_NE] = expr_##isa##_ne,                                        \
+            [OP_BITWISE_AND] = expr_##isa##_bitwise_and,                      \
+            [OP_BITWISE_OR] = expr_##isa##_bitwise_or,                        \
+            [OP_BITWISE_XOR] = expr_##isa##_bitwise_xor,                      \
+            [OP_SQRT] = expr_##isa##_sqrt,                                    \
+            [OP_ABS] = expr_##isa##_abs,                                      \
+            [OP_FLOOR] = expr_##isa##_floor,                                  \
+            [OP_CEIL] = expr_##isa##_ceil,                                    \
+            [OP_EXP] = expr_kernel_exp,                                       \
+            [OP_LOG] = expr_kernel_log,                                       \
+            [OP_SIN] = expr_kernel_sin,                                       \
+            [OP_COS] = expr_kernel_cos,                                       \
+            [OP_MIN] = expr_##isa##_min,                                      \
+            [OP_MAX] = expr_##isa##_max,                                      \
+            [OP_FMA] = EXPR_##isa##_FMA,                                      \
+            [OP_SELECT] = expr_##isa##_select,                                \
+        },                                                                    \
+        expr_##isa##_jz, expr_##isa##_jnz, expr_##isa##_blend,                \
+    }
+
+/* fmaf() is exact, AVX2 alone has no fused multiply-add */
+#define EXPR_avx2_FMA expr_kernel_fma
+#define EXPR_avx512_FMA expr_avx512_fma
+
+static const struct expr_kernels expr_avx2_kernels = EXPR_SIMD_KERNELS(avx2);
+static const struct expr_kernels expr_avx512_kernels
+    = EXPR_SIMD_KERNELS(avx512);
+#endif
+
+static const struct expr_kernels *expr_batch_kernels(void)
+{
+#ifdef EXPR_SIMD
+    if (__builtin_cpu_supports("avx512f")) {
+        return &expr_avx512_kernels;
+    } else if (__builtin_cpu_supports("avx2")) {
+        return &expr_avx2_kernels;
+    }
+#endif
+    return &expr_scalar_kernels;
+}
+
+struct expr_batch_jump {
+    int target;
+    int dst;
+    uint32_t mask[EXPR_BATCH_SIZE];
+    float saved[EXPR_BATCH_SIZE];
+};
+
+struct expr_batch {
+    struct expr_program *p;
+    const struct expr_kernels *k;
+    int *slot;    /* variable slot of each instruction */
+    float **vars; /* distinct variables of the program */
+    int *cols;    /* column bound to each variable, or -1 */
+    int nvars;
+    int njumps;
+    float *regs;  /* nregs blocks of lanes */
+    float *lanes; /* nvars blocks of lanes */
+    struct expr_batch_jump *jumps;
+};
+
+/* Rows can only be evaluated side by side if every row is independent from
+ * the previous ones: no lazy user functions, no native functions or
+ * assignments that depend on && or ||, and no unbound variable that is read
+ * before it is assigned. The only moves that may depend on && or || are the
+ * ones ending them, into the register that is blended at the jump target. */
+static int expr_batch_vectorizable(struct expr_batch *bt)
+{
+    int region = 0;
+    int ok = 1;
+    int n = vec_len(&bt->p->code);
+    unsigned char *seen = (unsigned char *)calloc(bt->nvars + 1, 1);
+    int *blend = (int *)calloc(n + 1, sizeof(int)); /* dst + 1 at targets */
+    if (!seen || !blend) {
+        free(seen);
+        free(blend);
+        return 0;
+    }
+    for (int pc = 0; pc < n && ok; pc++) {
+        struct expr_insn *i = &vec_nth(&bt->p->code, pc);
+        if (i->op == VM_JZ || i->op == VM_JNZ) {
+            region = i->b > region ? i->b : region;
+            blend[i->b] = i->dst + 1;
+        } else if (i->op == VM_MOV) {
+            ok = pc >= region || blend[pc + 1] == i->dst + 1;
+        } else if (i->op == VM_CALL) {
+            ok = pc >= region;
+        } else if (i->op == OP_ASSIGN) {
+            int s = bt->slot[pc];
+            ok = pc >= region && (bt->cols[s] >= 0 || !seen[s]);
+            seen[s] = 1;
+        } else if (i->op == OP_VAR) {
+            seen[bt->slot[pc]] = 1;
+        } else if (i->op <= OP_SELECT && i->op != OP_CONST
+            && expr_scalar_kernels.ops[i->op] == NULL) {
+            ok = 0;
+        }
+    }
+    free(seen);
+    free(blend);
+    return ok;
+}
+
+/* Argument k of the native function e is in the lanes at a + k blocks */
+static void expr_batch_call(struct expr *e, const float *a, float *d, int m)
+{
+    struct expr_func *f = e->param.func.f;
+    int n = vec_len(&e->param.func.args);
+    if (f->batch) {
+        const float *cols[n > 0 ? n : 1];
+        for (int k = 0; k < n; k++) {
+            cols[k] = a + k * EXPR_BATCH_SIZE;
+        }
+        f->batch(f, cols, n, d, m, e->param.func.context);
+        return;
+    }
+    float args[n > 0 ? n : 1];
+    for (int row = 0; row < m; row++) {
+        for (int k = 0; k < n; k++) {
+            args[k] = a[k * EXPR_BATCH_SIZE + row];
+        }
+        d[row] = f->native(f, args, n, e->param.func.context);
+    }
+}
+
+static void expr_batch_block(struct expr_batch *bt, float *out, int m)
+{
+    struct expr_insn *code = bt->p->code.buf;
+    int top = 0;
+    for (int pc = 0;; pc++) {
+        struct expr_insn *i = &code[pc];
+        while (top > 0 && bt->jumps[top - 1].target == pc) {
+            struct expr_batch_jump *j = &bt->jumps[--top];
+            bt->k->blend(bt->regs + j->dst * EXPR_BATCH_SIZE, j->mask,
+                j->saved, m);
+        }
+        float *d = bt->regs + i->dst * EXPR_BATCH_SIZE;
+        float *a = bt->regs + i->a * EXPR_BATCH_SIZE;
+        float *b = bt->regs + i->b * EXPR_BATCH_SIZE;
+        float *c = (i->op == OP_FMA || i->op == OP_SELECT)
+            ? bt->regs + i->param.c * EXPR_BATCH_SIZE : a;
+        float *v = bt->lanes + bt->slot[pc] * EXPR_BATCH_SIZE;
+        struct expr_batch_jump *j;
+        int taken;
+        switch (i->op) {
+        case OP_CONST:
+            for (int k = 0; k < m; k++) {
+                d[k] = i->param.value;
+            }
+            break;
+        case OP_VAR:
+            memcpy(d, v, m * sizeof(float));
+            break;
+        case OP_ASSIGN:
+            memcpy(v, a, m * sizeof(float));
+            /* fallthrough */
+        case VM_MOV:
+            if (d != a) {
+                memcpy(d, a, m * sizeof(float));
+            }
+            break;
+        case VM_JZ:
+        case VM_JNZ:
+            j = &bt->jumps[top];
+            taken = (i->op == VM_JZ ? bt->k->jz : bt->k->jnz)(
+                j->mask, j->saved, a, m);
+            if (taken == m) {
+                memcpy(d, j->saved, m * sizeof(float));
+                pc = i->b - 1;
+            } else if (taken > 0) {
+                j->target = i->b;
+                j->dst = i->dst;
+                top++;
+            }
+            break;
+        case VM_CALL:
+            expr_batch_call(i->param.func, a, d, m);
+            break;
+        case VM_RET:
+            memcpy(out, a, m * sizeof(float));
+            return;
+        default:
+            bt->k->ops[i->op](d, a, b, c, m);
+            break;
+        }
+    }
+}
+
+static int expr_batch_init(struct expr_batch *bt, struct expr_program *p,
+    const struct expr_column *cols, int ncols)
+{
+    int len = vec_len(&p->code);
+    memset(bt, 0, sizeof(*bt));
+    bt->p = p;
+    bt->k = expr_batch_kernels();
+    bt->slot = (int *)calloc(len, sizeof(int));
+    bt->vars = (float **)calloc(len, sizeof(float *));
+    bt->cols = (int *)calloc(len, sizeof(int));
+    if (!bt->slot || !bt->vars || !bt->cols) {
+        return -1;
+    }
+    for (int pc = 0; pc < len; pc++) {
+        struct expr_insn *i = &vec_nth(&p->code, pc);
+        if (i->op == VM_JZ || i->op == VM_JNZ) {
+            bt->njumps++;
+        } else if (i->op == OP_VAR || i->op == OP_ASSIGN) {
+            int s = 0;
+            while (s < bt->nvars && bt->vars[s] != i->param.var) {
+                s++;
+            }
+            if (s == bt->nvars) {
+                bt->vars[bt->nvars++] = i->param.var;
+                bt->cols[s] = -1;
+                for (int c = 0; c < ncols; c++) {
+                    if (&cols[c].var->value == i->param.var) {
+                        bt->cols[s] = c;
+                    }
+                }
+            }
+            bt->slot[pc] = s;
+        }
+    }
+    return 0;
+}
+
+/* Per-call blocks, the rest of the state can be shared between threads */
+static int expr_batch_alloc(struct expr_batch *bt)
+{
+    bt->regs = (float *)malloc(
+        (bt->p->nregs + 1) * EXPR_BATCH_SIZE * sizeof(float));
+    bt->lanes = (float *)malloc(
+        (bt->nvars + 1) * EXPR_BATCH_SIZE * sizeof(float));
+    bt->jumps = (struct expr_batch_jump *)malloc(
+        (bt->njumps + 1) * sizeof(struct expr_batch_jump));
+    return (bt->regs && bt->lanes && bt->jumps) ? 0 : -1;
+}
+
+/* Evaluates rows [row, end), the lanes keep the variables of the last block */
+static void expr_batch_rows(struct expr_batch *bt,
+    const struct expr_column *cols, float *out, size_t row, size_t end)
+{
+    int m = 0;
+    for (; row < end; row += m) {
+        m = (end - row < EXPR_BATCH_SIZE) ? (int)(end - row) : EXPR_BATCH_SIZE;
+        for (int s = 0; s < bt->nvars; s++) {
+            float *v = bt->lanes + s * EXPR_BATCH_SIZE;
+            const struct expr_column *col
+                = bt->cols[s] >= 0 ? &cols[bt->cols[s]] : NULL;
+            if (col == NULL) {
+                for (int k = 0; k < m; k++) {
+                    v[k] = *bt->vars[s];
+                }
+            } else if (col->stride == 1) {
+                memcpy(v, col->data + row, m * sizeof(float));
+            } else {
+                for (int k = 0; k < m; k++) {
+                    v[k] = col->data[(row + k) * col->stride];
+                }
+            }
+        }
+        expr_batch_block(bt, out + row, m);
+    }
+}
+
+/* Leaves variables as if the row in lane k of the last block was evaluated
+ * on its own */
+static void expr_batch_store(struct expr_batch *bt, int k)
+{
+    for (int s = 0; s < bt->nvars; s++) {
+        *bt->vars[s] = bt->lanes[s * EXPR_BATCH_SIZE + k];
+    }
+}
+
+static void expr_batch_free(struct expr_batch *bt)
+{
+    free(bt->slot);
+    free(bt->vars);
+    free(bt->cols);
+    free(bt->regs);
+    free(bt->lanes);
+    free(bt->jumps);
+}
+
+int expr_program_eval_batch(struct expr_program *p,
+    const struct expr_column *cols, int ncols, float *out, size_t n)
+{
+    struct expr_batch bt;
+    if (p->flags & EXPR_COMPILE_FRAME) {
+        return -1;
+    }
+    if (expr_batch_init(&bt, p, cols, ncols) == -1) {
+        expr_batch_free(&bt);
+        return -1;
+    }
+    if (!expr_batch_vectorizable(&bt)) {
+        /* Fall back to one row at a time */
+        for (size_t row = 0; row < n; row++) {
+            for (int c = 0; c < ncols; c++) {
+                cols[c].var->value = cols[c].data[row * cols[c].stride];
+            }
+            out[row] = expr_program_eval(p);
+        }
+        expr_batch_free(&bt);
+        return 0;
+    }
+    if (expr_batch_alloc(&bt) == -1) {
+        expr_batch_free(&bt);
+        return -1;
+    }
+    if (n > 0) {
+        expr_batch_rows(&bt, cols, out, 0, n);
+        expr_batch_store(&bt, (int)((n - 1) % EXPR_BATCH_SIZE));
+    }
+    expr_batch_free(&bt);
+    return 0;
+}
+
+int expr_eval_batch(struct expr *e, const struct expr_column *cols,
+    int ncols, float *out, size_t n)
+{
+    struct expr_program *p = expr_compile(e);
+    if (!p) {
+        return -1;
+    }
+    int r = expr_program_eval_batch(p, cols, ncols, out, n);
+    expr_program_destroy(p);
+    return r;
+}
+
+/*
+ * Worker pool. A job is split into chunks, numbered from 0, and each worker
+ * starts with an even share of them. A worker takes chunks from the front
+ * of its own range and, once it runs dry, steals from the back of the
+ * others. Both ends of a range are packed in one word and updated with a
+ * compare-and-swap, so a chunk is never taken twice. The calling thread
+ * works as worker 0.
+ */
+typedef void (*expr_pool_fn)(void *arg, int worker, size_t chunk);
+
+struct expr_pool_range {
+    uint64_t range; /* first chunk << 32 | end */
+    char pad[56];   /* one cache line per worker */
+};
+
+struct expr_pool {
+    int nworkers;
+    struct expr_pool_range *ranges;
+    expr_pool_fn fn;
+    void *arg;
+#ifdef EXPR_THREADS
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    unsigned int generation;
+    int busy;
+    int stop;
+#endif
+};
+
+static int64_t expr_pool_take(struct expr_pool_range *r, int steal)
+{
+    uint64_t old = __atomic_load_n(&r->range, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint64_t lo = old >> 32, hi = old & 0xffffffff;
+        if (lo >= hi) {
+            return -1;
+        }
+        uint64_t next = steal ? (lo << 32 | (hi - 1)) : ((lo + 1) << 32 | hi);
+        if (__atomic_compare_exchange_n(&r->range, &old, next, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return (int64_t)(steal ? hi - 1 : lo);
+        }
+    }
+}
+
+static void expr_pool_work(struct expr_pool *pool, int id)
+{
+    int64_t chunk;
+    while ((chunk = expr_pool_take(&pool->ranges[id], 0)) >= 0) {
+        pool->fn(pool->arg, id, (size_t)chunk);
+    }
+    for (int k = 1; k < pool->nworkers; k++) {
+        int victim = (id + k) % pool->nworkers;
+        while ((chunk = expr_pool_take(&pool->ranges[victim], 1)) >= 0) {
+            pool->fn(pool->arg, id, (size_t)chunk);
+        }
+    }
+}
+
+#ifdef EXPR_THREADS
+struct expr_pool_thread {
+    struct expr_pool *pool;
+    int id;
+};
+
+static void *expr_pool_main(void *arg)
+{
+    struct expr_pool_thread t = *(struct expr_pool_thread *)arg;
+    struct expr_pool *pool = t.pool;
+    free(arg);
+    unsigned int seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && pool->generation == seen) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        expr_pool_work(pool, t.id);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) {
+            pthread_cond_signal(&pool->idle);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+#endif
+
+struct expr_pool *expr_pool_create(int nthreads)
+{
+    struct expr_pool *pool = calloc(1, sizeof(struct expr_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+#ifdef EXPR_THREADS
+    if (nthreads <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (n > 0 ? (int)n : 1);
+    }
+#else
+    nthreads = 1;
+#endif
+    pool->ranges = calloc(nthreads, sizeof(struct expr_pool_range));
+    if (pool->ranges == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pool->nworkers = 1;
+#ifdef EXPR_THREADS
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        expr_pool_destroy(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    /* Fewer threads than asked for is not an error */
+    while (pool->nworkers < nthreads) {
+        struct expr_pool_thread *t = malloc(sizeof(struct expr_pool_thread));
+        if (t == NULL) {
+            break;
+        }
+        t->pool = pool;
+        t->id = pool->nworkers;
+        if (pthread_create(&pool->threads[t->id], NULL, expr_pool_main, t)) {
+            free(t);
+            break;
+        }
+        pool->nworkers++;
+    }
+#endif
+    return pool;
+}
+
+int expr_pool_size(struct expr_pool *pool)
+{
+    return pool->nworkers;
+}
+
+/* Runs fn over chunks [0, nchunks), returns when all of them are done */
+static void expr_pool_run(
+    struct expr_pool *pool, size_t nchunks, expr_pool_fn fn, void *arg)
+{
+    int n = pool->nworkers;
+    for (int k = 0; k < n; k++) {
+        uint64_t lo = nchunks * k / n, hi = nchunks * (k + 1) / n;
+        pool->ranges[k].range = lo << 32 | hi;
+    }
+    pool->fn = fn;
+    pool->arg = arg;
+#ifdef EXPR_THREADS
+    if (n > 1) {
+        pthread_mutex_lock(&pool->lock);
+        pool->busy = n - 1;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+#endif
+    expr_pool_work(pool, 0);
+#ifdef EXPR_THREADS
+    if (n > 1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->busy > 0) {
+            pthread_cond_wait(&pool->idle, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+#endif
+}
+
+void expr_pool_destroy(struct expr_pool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+#ifdef EXPR_THREADS
+    if (pool->threads) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = 1;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+        for (int k = 1; k < pool->nworkers; k++) {
+            pthread_join(pool->threads[k], NULL);
+        }
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->wake);
+        pthread_cond_destroy(&pool->idle);
+        free(pool->threads);
+    }
+#endif
+    free(pool->ranges);
+    free(pool);
+}
+
+/*
+ * Parallel batch evaluation. Workers share the analysis of the program and
+ * own their register and lane blocks.
+ */
+#define EXPR_PARALLEL_CHUNK (32 * EXPR_BATCH_SIZE)
+
+struct expr_parallel {
+    struct expr_batch *workers;
+    const struct expr_column *cols;
+    float *out;
+    size_t n;
+    size_t chunk;
+};
+
+static void expr_parallel_chunk(void *arg, int worker, size_t chunk)
+{
+    struct expr_parallel *par = (struct expr_parallel *)arg;
+    size_t row = chunk * par->chunk;
+    size_t end = (par->n - row < par->chunk) ? par->n : row + par->chunk;
+    expr_batch_rows(&par->workers[worker], par->cols, par->out, row, end);
+}
+
+int expr_program_eval_parallel(struct expr_pool *pool,
+    struct expr_program *p, const struct expr_column *cols, int ncols,
+    float *out, size_t n, size_t chunk)
+{
+    struct expr_batch bt;
+    if (p->flags & EXPR_COMPILE_FRAME) {
+        return -1;
+    }
+    if (expr_batch_init(&bt, p, cols, ncols) == -1) {
+        expr_batch_free(&bt);
+        return -1;
+    }
+    if (!expr_batch_vectorizable(&bt) || n == 0) {
+        /* Rows depend on each other */
+        expr_batch_free(&bt);
+        return expr_program_eval_batch(p, cols, ncols, out, n);
+    }
+    int nworkers = pool->nworkers;
+    struct expr_batch *workers = calloc(nworkers, sizeof(struct expr_batch));
+    int r = (workers ? 0 : -1);
+    for (int k = 0; k < nworkers && r == 0; k++) {
+        workers[k] = bt;
+        workers[k].regs = NULL;
+        workers[k].lanes = NULL;
+        workers[k].jumps = NULL;
+        r = expr_batch_alloc(&workers[k]);
+    }
+    if (r == 0) {
+        struct expr_parallel par = { workers, cols, out, n,
+            chunk > 0 ? chunk : EXPR_PARALLEL_CHUNK };
+        while ((n - 1) / par.chunk >= 0xffffffff) {
+            par.chunk *= 2; /* chunk numbers are 32-bit */
+        }
+        expr_pool_run(pool, (n + par.chunk - 1) / par.chunk,
+            expr_parallel_chunk, &par);
+        /* Variables are written back by this thread only */
+        expr_batch_rows(&workers[0], cols, out, n - 1, n);
+        expr_batch_store(&workers[0], 0);
+    }
+    for (int k = 0; workers && k < nworkers; k++) {
+        free(workers[k].regs);
+        free(workers[k].lanes);
+        free(workers[k].jumps);
+    }
+    free(workers);
+    expr_batch_free(&bt);
+    return r;
+}
+
+int expr_eval_parallel(struct expr_pool *pool, struct expr *e,
+    const struct expr_column *cols, int ncols, float *out, size_t n,
+    size_t chunk)
+{
+    struct expr_program *p = expr_compile(e);
+    if (!p) {
+        return -1;
     }
+    int r = expr_program_eval_parallel(pool, p, cols, ncols, out, n, chunk);
+    expr_program_destroy(p);
+    return r;
 }
@@ -51,9 +51,14 @@ int vec_expand(char **buf, int *length, int *cap, int memsz)
  * Expression data types
  */
 struct expr_func;
+struct expr_macro;
 typedef vec(struct expr) vec_expr_t;
 typedef void (*exprfn_cleanup_t)(struct expr_func *f, void *context);
 typedef float (*exprfn_t)(struct expr_func *f, vec_expr_t args, void *context);
+typedef float (*exprfn_native_t)(
+    struct expr_func *f, const float *args, int nargs, void *context);
+typedef void (*exprfn_batch_t)(struct expr_func *f, const float *const *args,
+    int nargs, float *out, size_t n, void *context);
 
 struct expr {
     int type;
@@ -66,6 +71,11 @@ struct expr {
             vec_expr_t args;
             void *context;
         } func;
+        struct {
+            vec_expr_t args;
+            struct expr_macro *macro;
+        } call;
+        struct { int index; } arg;
     } param;
 };
 
@@ -90,29 +100,145 @@ struct expr_func {
     exprfn_t f;
     exprfn_cleanup_t cleanup;
     size_t ctxsz;
+    exprfn_native_t native; /* takes evaluated arguments, when f is NULL */
+    exprfn_batch_t batch;   /* optional, same as native on n rows at once */
 };
 
 struct expr_func *expr_func(struct expr_func *funcs, const char *s, size_t len);
 
+struct expr_func_registry;
+
+struct expr_func_registry *expr_func_registry_create(struct expr_func *funcs);
+struct expr_func *expr_func_registry_find(
+    struct expr_func_registry *r, const char *s, size_t len);
+void expr_func_registry_destroy(struct expr_func_registry *r);
+
 /*
  * Variables
  */
 struct expr_var {
-    float value;
+    float value; /* first, so nodes pointing at it lead back to the var */
+    unsigned int hash;
+    size_t len;
+    int index; /* creation order, the slot in frames */
     struct expr_var *next;
     char name[];
 };
 
 struct expr_var_list {
     struct expr_var *head;
+    struct expr_var **table; /* hash index over the list */
+    unsigned int cap;
+    unsigned int len;
 };
 
 struct expr_var *expr_var(struct expr_var_list *vars, const char *s, size_t len);
+struct expr_var *expr_var_next(struct expr_var_list *vars, struct expr_var *v);
 
 float expr_eval(struct expr *e);
 float expr_eval_with_dfs(struct expr *e);
 float expr_eval_with_asm(struct expr *e);
 
+/*
+ * Compact expressions
+ */
+struct expr_node {
+    int type;
+    int a; /* first child, as the distance back to it */
+    union {
+        struct { int b, c; } op; /* second and third child, likewise */
+        float *var;
+        float value;
+    } param;
+};
+
+struct expr_compact {
+    struct expr_node *nodes; /* children first, the root is the last one */
+    int len;
+    int *args;           /* argument lists of calls, as indices of nodes */
+    struct expr **funcs; /* custom function calls in the source expression */
+    struct expr_compact_macro {
+        int body; /* index of the root node of the body */
+        int nparams;
+    } *macros;
+    size_t size; /* bytes taken by the whole copy */
+};
+
+struct expr_compact *expr_compact(struct expr *e);
+float expr_compact_eval(struct expr_compact *c);
+void expr_compact_destroy(struct expr_compact *c);
+
+/*
+ * Compiled programs
+ */
+struct expr_insn {
+    int op;
+    int dst;
+    int a, b; /* operand registers, b is the target of jumps */
+    union {
+        float value;
+        float *var;
+        struct expr *func;
+        int c; /* third operand register */
+    } param;
+    const void *handler; /* threaded-code address of the opcode handler */
+};
+
+typedef vec(struct expr_insn) vec_insn_t;
+
+struct expr_program {
+    vec_insn_t code;
+    int flags;
+    int nregs;
+    int nslots; /* frame size needed by expr_program_eval_frame() */
+    int eliminated; /* nodes removed by common subexpression elimination */
+    float *regs;
+    void *jit; /* native code, see expr_program_jit() */
+    size_t jitsz;
+};
+
+typedef float (*expr_jit_t)(void);
+
+#define EXPR_COMPILE_CSE (1 << 0)
+#define EXPR_COMPILE_FRAME (1 << 1)
+
+struct expr_program *expr_compile(struct expr *e);
+struct expr_program *expr_compile_ex(struct expr *e, int flags);
+float expr_program_eval(struct expr_program *p);
+float expr_program_eval_frame(struct expr_program *p, float *slots);
+void expr_program_destroy(struct expr_program *p);
+expr_jit_t expr_program_jit(struct expr_program *p);
+
+/*
+ * Batch evaluation
+ */
+struct expr_column {
+    struct expr_var *var;
+    const float *data;
+    size_t stride; /* distance between two rows, in floats */
+};
+
+int expr_eval_batch(struct expr *e, const struct expr_column *cols,
+    int ncols, float *out, size_t n);
+int expr_program_eval_batch(struct expr_program *p,
+    const struct expr_column *cols, int ncols, float *out, size_t n);
+
+/*
+ * Parallel batch evaluation
+ */
+struct expr_pool;
+
+struct expr_pool *expr_pool_create(int nthreads);
+int expr_pool_size(struct expr_pool *pool);
+void expr_pool_destroy(struct expr_pool *pool);
+
+int expr_eval_parallel(struct expr_pool *pool, struct expr *e,
+    const struct expr_column *cols, int ncols, float *out, size_t n,
+    size_t chunk);
+int expr_program_eval_parallel(struct expr_pool *pool,
+    struct expr_program *p, const struct expr_column *cols, int ncols,
+    float *out, size_t n, size_t chunk);
+
 #define EXPR_TOP (1 << 0)
 #define EXPR_TOPEN (1 << 1)
 #define EXPR_TCLOSE (1 << 2)
@@ -130,6 +256,49 @@ struct expr *expr_create(const char *s, size_t len,
 
 void expr_destroy(struct expr *e, struct expr_var_list *vars);
 
+/*
+ * Arenas
+ */
+struct expr_arena;
+
+struct expr_arena *expr_arena_create(size_t size);
+void expr_arena_reset(struct expr_arena *a);
+void expr_arena_destroy(struct expr_arena *a);
+
+struct expr *expr_create_in(struct expr_arena *arena, const char *s,
+    size_t len, struct expr_var_list *vars, struct expr_func *funcs);
+struct expr *expr_create_with(struct expr_arena *arena, const char *s,
+    size_t len, struct expr_var_list *vars,
+    struct expr_func_registry *registry);
+
+/*
+ * Rewriting
+ */
+#define EXPR_SIMPLIFY_FAST_MATH (1 << 0)
+
+int expr_rebalance(struct expr *e);
+int expr_simplify(struct expr_arena *arena, struct expr *e, int flags);
+
+/*
+ * Expression cache
+ */
+struct expr_cache;
+
+struct expr_cache_stats {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;
+    size_t bytes;
+};
+
+struct expr_cache *expr_cache_create(size_t budget);
+struct expr *expr_cache_get(struct expr_cache *c, const char *s, size_t len,
+    struct expr_var_list *vars, struct expr_func *funcs);
+void expr_cache_release(struct expr_cache *c, struct expr *e);
+void expr_cache_get_stats(struct expr_cache *c, struct expr_cache_stats *st);
+void expr_cache_destroy(struct expr_cache *c);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
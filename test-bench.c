@@ -1,9 +1,10 @@
 #include "expression.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <time.h>
 
 int status = 0;
 
@@ -19,46 +20,660 @@ static struct expr_func user_funcs[] = {
     { NULL, NULL, NULL, 0 },
 };
 
-static void test_benchmark(const char *s)
+static const char *bench_exprs[] = {
+    "5",
+    "5+5+5+5+5+5+5+5+5+5",
+    "5*5*5*5*5*5*5*5*5*5",
+    "5,5,5,5,5,5,5,5,5,5",
+    "((5+5)+(5+5))+((5+5)+(5+5))+(5+5)",
+    "x=5",
+    "x=5,x+x+x+x+x+x+x+x+x+x",
+    "x=5,((x+x)+(x+x))+((x+x)+(x+x))+(x+x)",
+    "a=1,b=2,c=3,d=4,e=5,f=6,g=7,h=8,i=9,j=10",
+    "a=1,a=2,a=3,a=4,a=5,a=6,a=7,a=8,a=9,a=10",
+    "$(sqr,$1*$1),5*5",
+    "$(sqr,$1*$1),sqr(5)",
+    "x=2+3*(x/(42+next(x))),x",
+    "a,b,c,d,e,d,e,f,g,h,i,j,k",
+    "$(a,1),$(b,2),$(c,3),$(d,4),5",
+    "x=x+1,sqrt(x*x+1)+min(x,3)*clamp(x,0,2)",
+    "x=x+1,(x<3&&x>1)||x==7",
+};
+
+/*
+ * Allocation counting, by interposing malloc on glibc. Sanitizers bring
+ * their own allocator, counts stay zero under them.
+ */
+#if defined(__SANITIZE_ADDRESS__)
+#define BENCH_NO_ALLOCS
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define BENCH_NO_ALLOCS
+#endif
+#endif
+
+static size_t nallocs; /* calls to malloc, calloc and realloc */
+static size_t nbytes;  /* bytes they were asked for */
+
+#if defined(__GLIBC__) && !defined(BENCH_NO_ALLOCS)
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t k, size_t n);
+extern void *__libc_realloc(void *p, size_t n);
+
+void *malloc(size_t n)
+{
+    nallocs++, nbytes += n;
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t k, size_t n)
+{
+    nallocs++, nbytes += k * n;
+    return __libc_calloc(k, n);
+}
+
+void *realloc(void *p, size_t n)
+{
+    nallocs++, nbytes += n;
+    return __libc_realloc(p, n);
+}
+#endif
+
+/*
+ * Timing
+ */
+static int trials = 21;        /* measured trials per cell */
+static double min_trial = 1e6; /* ns a trial should take at least */
+
+static volatile float sink; /* keeps results from being optimized out */
+
+static double bench_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+struct bench_stats {
+    double median; /* ns per operation */
+    double p99;
+    double allocs; /* allocations per operation */
+    double bytes;
+};
+
+static void bench_stats(double *t, int n, struct bench_stats *st)
+{
+    qsort(t, n, sizeof(*t), bench_cmp);
+    st->median = (n % 2) ? t[n / 2] : (t[n / 2 - 1] + t[n / 2]) / 2;
+    st->p99 = t[(int)ceil(0.99 * n) - 1]; /* nearest rank */
+}
+
+/*
+ * Evaluators
+ */
+struct bench_ctx {
+    struct expr *e;
+    struct expr_program *p;
+    expr_jit_t jit;
+    struct expr_compact *k;
+};
+
+#define BENCH_ROWS 256
+
+#define BENCH_LOOP(name, call)                                                \
+    static float bench_##name(struct bench_ctx *c, long n)                    \
+    {                                                                         \
+        float sum = 0;                                                        \
+        for (long i = 0; i < n; i++) {                                        \
+            sum += (call);                                                    \
+        }                                                                     \
+        return sum;                                                           \
+    }
+
+BENCH_LOOP(eval, expr_eval(c->e))
+BENCH_LOOP(dfs, expr_eval_with_dfs(c->e))
+BENCH_LOOP(asm, expr_eval_with_asm(c->e))
+BENCH_LOOP(vm, expr_program_eval(c->p))
+BENCH_LOOP(jit, c->jit())
+BENCH_LOOP(compact, expr_compact_eval(c->k))
+
+static float bench_batch(struct bench_ctx *c, long n)
+{
+    float out[BENCH_ROWS];
+    float sum = 0;
+    for (long i = 0; i < n; i += BENCH_ROWS) {
+        size_t rows = n - i < BENCH_ROWS ? n - i : BENCH_ROWS;
+        expr_program_eval_batch(c->p, NULL, 0, out, rows);
+        sum += out[rows - 1];
+    }
+    return sum;
+}
+
+struct bench_backend {
+    const char *name;
+    int compile;  /* -1 for tree evaluators, compile flags otherwise */
+    int jit;      /* needs native code */
+    int compact;  /* needs a compact copy */
+    int balance;  /* runs on the rebalanced tree */
+    int deep;     /* doesn't recurse, safe on very deep expressions */
+    float (*run)(struct bench_ctx *c, long n);
+};
+
+static const struct bench_backend backends[] = {
+    { "eval", -1, 0, 0, 0, 0, bench_eval },
+    { "dfs", -1, 0, 0, 0, 1, bench_dfs },
+    { "asm", -1, 0, 0, 0, 0, bench_asm },
+    { "compact", -1, 0, 1, 0, 0, bench_compact },
+    { "vm", 0, 0, 0, 0, 0, bench_vm },
+    { "vm+cse", EXPR_COMPILE_CSE, 0, 0, 0, 0, bench_vm },
+    { "jit", 0, 1, 0, 0, 0, bench_jit },
+    { "jit+bal", 0, 1, 0, 1, 0, bench_jit },
+    { "batch", 0, 0, 0, 0, 0, bench_batch },
+};
+
+#define NBACKENDS (int)(sizeof(backends) / sizeof(backends[0]))
+
+static int bench_prepare(struct bench_ctx *c, const struct bench_backend *b,
+    const char *s, struct expr_var_list *vars)
+{
+    memset(c, 0, sizeof(*c));
+    c->e = expr_create(s, strlen(s), vars, user_funcs);
+    if (c->e == NULL) {
+        return -1;
+    }
+    if (b->balance && expr_rebalance(c->e) < 0) {
+        return -1;
+    }
+    if (b->compile >= 0 &&
+        (c->p = expr_compile_ex(c->e, b->compile)) == NULL) {
+        return -1;
+    }
+    if (b->jit && (c->jit = expr_program_jit(c->p)) == NULL) {
+        return -1;
+    }
+    if (b->compact && (c->k = expr_compact(c->e)) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+static void bench_release(struct bench_ctx *c, struct expr_var_list *vars)
+{
+    if (c->p != NULL) {
+        expr_program_destroy(c->p);
+    }
+    expr_compact_destroy(c->k);
+    expr_destroy(c->e, vars);
+}
+
+/* Evaluates once on fresh variables, to check the evaluator agrees */
+static int bench_result(const struct bench_backend *b, const char *s,
+    float *r)
 {
-    struct timeval t;
-    gettimeofday(&t, NULL);
-    double start = t.tv_sec + t.tv_usec * 1e-6;
     struct expr_var_list vars = { 0 };
-    struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
-    if (e == NULL) {
-        printf("FAIL: %s can't be compiled\n", s);
+    struct bench_ctx c;
+    if (bench_prepare(&c, b, s, &vars) < 0) {
+        bench_release(&c, &vars);
+        return -1;
+    }
+    *r = b->run(&c, 1);
+    bench_release(&c, &vars);
+    return 0;
+}
+
+/* Finds how many iterations fill a trial, which also warms up */
+static long bench_calibrate(float (*run)(struct bench_ctx *, long),
+    struct bench_ctx *c)
+{
+    long n = 1;
+    for (;;) {
+        double start = bench_now();
+        sink = run(c, n);
+        if (bench_now() - start >= min_trial || n >= (1L << 30)) {
+            return n;
+        }
+        n *= 2;
+    }
+}
+
+static void bench_eval_cell(const struct bench_backend *b, const char *s,
+    struct bench_stats *st)
+{
+    struct expr_var_list vars = { 0 };
+    struct bench_ctx c;
+    double t[trials];
+    if (bench_prepare(&c, b, s, &vars) < 0) {
+        bench_release(&c, &vars);
+        st->median = st->p99 = NAN;
+        return;
+    }
+    long n = bench_calibrate(b->run, &c);
+    sink = b->run(&c, n);
+    size_t allocs = nallocs, bytes = nbytes;
+    for (int i = 0; i < trials; i++) {
+        double start = bench_now();
+        sink = b->run(&c, n);
+        t[i] = (bench_now() - start) / n;
+    }
+    st->allocs = (double)(nallocs - allocs) / n / trials;
+    st->bytes = (double)(nbytes - bytes) / n / trials;
+    bench_stats(t, trials, st);
+    bench_release(&c, &vars);
+}
+
+#define BENCH_BATCH 1024
+
+/* Times expr_create and expr_destroy on the same batch of expressions, fewer
+ * of them when they are long */
+static void bench_parse_cell(const char *s, struct bench_stats *parse,
+    struct bench_stats *destroy)
+{
+    static struct expr *e[BENCH_BATCH];
+    struct expr_var_list vars = { 0 };
+    double tp[trials], td[trials];
+    size_t len = strlen(s);
+    int batch = (len < BENCH_BATCH ? BENCH_BATCH : 1 + 65536 / len);
+    size_t allocs = 0, bytes = 0;
+    for (int i = -1; i < trials; i++) {
+        size_t a = nallocs, b = nbytes;
+        double start = bench_now();
+        for (int k = 0; k < batch; k++) {
+            e[k] = expr_create(s, len, &vars, user_funcs);
+        }
+        double mid = bench_now();
+        for (int k = 0; k < batch; k++) {
+            expr_destroy(e[k], NULL);
+        }
+        double end = bench_now();
+        if (i >= 0) { /* the first round is a warmup */
+            tp[i] = (mid - start) / batch;
+            td[i] = (end - mid) / batch;
+            allocs += nallocs - a, bytes += nbytes - b;
+        }
+    }
+    expr_destroy(NULL, &vars);
+    bench_stats(tp, trials, parse);
+    bench_stats(td, trials, destroy);
+    /* Destroying only frees, every allocation is counted to parsing */
+    parse->allocs = (double)allocs / batch / trials;
+    parse->bytes = (double)bytes / batch / trials;
+    destroy->allocs = destroy->bytes = 0;
+}
+
+/*
+ * Reports
+ */
+enum { BENCH_TABLE, BENCH_CSV, BENCH_JSON };
+
+static int format = BENCH_TABLE;
+static FILE *out;
+static int nreports;
+
+static void bench_header(void)
+{
+    if (format == BENCH_CSV) {
+        fprintf(out, "expression,backend,ns_op,p99,ops_sec,allocs,bytes\n");
+    } else if (format == BENCH_JSON) {
+        fprintf(out, "[");
+    } else {
+        fprintf(out, "%-40s %13s %13s", "ns/op, median/p99", "parse",
+            "destroy");
+        for (int i = 0; i < NBACKENDS; i++) {
+            fprintf(out, " %13s", backends[i].name);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+static void bench_footer(void)
+{
+    if (format == BENCH_JSON) {
+        fprintf(out, "\n]\n");
+    }
+}
+
+/* Writes s as a quoted CSV or JSON string */
+static void bench_quote(const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"') {
+            fputs(format == BENCH_CSV ? "\"\"" : "\\\"", out);
+        } else if (*s == '\\' && format == BENCH_JSON) {
+            fputs("\\\\", out);
+        } else if ((unsigned char)*s < 0x20 && format == BENCH_JSON) {
+            fprintf(out, "\\u%04x", *s);
+        } else {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void bench_report(const char *s, const char *backend,
+    const struct bench_stats *st)
+{
+    char buf[32];
+    if (format == BENCH_TABLE) {
+        if (isnan(st->median)) {
+            snprintf(buf, sizeof(buf), "-");
+        } else if (st->p99 < 1e5) {
+            snprintf(buf, sizeof(buf), "%.1f/%.1f", st->median, st->p99);
+        } else {
+            /* Deep expressions take long enough to be read in microseconds */
+            snprintf(buf, sizeof(buf), "%.0fus/%.0fus", st->median / 1e3,
+                st->p99 / 1e3);
+        }
+        fprintf(out, " %13s", buf);
+        return;
+    }
+    if (isnan(st->median)) {
+        return; /* skipped evaluators are left out */
+    }
+    if (format == BENCH_CSV) {
+        bench_quote(s);
+        fprintf(out, ",%s,%.2f,%.2f,%.0f,%.2f,%.1f\n", backend, st->median,
+            st->p99, 1e9 / st->median, st->allocs, st->bytes);
+    } else {
+        fprintf(out, "%s\n  {\"expression\": ", nreports ? "," : "");
+        bench_quote(s);
+        fprintf(out,
+            ", \"backend\": \"%s\", \"ns_op\": %.2f, \"p99\": %.2f, "
+            "\"ops_sec\": %.0f, \"allocs\": %.2f, \"bytes\": %.1f}",
+            backend, st->median, st->p99, 1e9 / st->median, st->allocs,
+            st->bytes);
+    }
+    nreports++;
+}
+
+/*
+ * Baseline comparison
+ */
+struct bench_base {
+    char *expr;
+    char *backend;
+    double ns;
+    double allocs;
+};
+
+static vec(struct bench_base) baseline = vec_init();
+static double threshold = 10; /* percent */
+
+/* Reads one CSV field, unquoting it, returns the end of it or NULL */
+static char *bench_field(char *p, char **field)
+{
+    char *w = p;
+    *field = p;
+    if (*p != '"') {
+        p += strcspn(p, ",\r\n");
+        if (*p == '\0') {
+            return p;
+        }
+        *p = '\0';
+        return p + 1;
+    }
+    for (p++;; p++) {
+        if (*p == '\0') {
+            return NULL;
+        } else if (*p == '"' && p[1] == '"') {
+            *w++ = '"', p++;
+        } else if (*p == '"') {
+            *w = '\0';
+            return p[1] == ',' ? p + 2 : p + 1;
+        } else {
+            *w++ = *p;
+        }
+    }
+}
+
+static int bench_load(const char *path)
+{
+    char line[4096];
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        struct bench_base b;
+        char *expr, *backend, *ns, *p99, *ops, *allocs;
+        char *p = bench_field(line, &expr);
+        if (p == NULL || strcmp(expr, "expression") == 0) {
+            continue;
+        }
+        if ((p = bench_field(p, &backend)) == NULL ||
+            (p = bench_field(p, &ns)) == NULL ||
+            (p = bench_field(p, &p99)) == NULL ||
+            (p = bench_field(p, &ops)) == NULL ||
+            bench_field(p, &allocs) == NULL) {
+            continue;
+        }
+        b.expr = strdup(expr);
+        b.backend = strdup(backend);
+        b.ns = atof(ns);
+        b.allocs = atof(allocs);
+        vec_push(&baseline, b);
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Fails the run if the case is slower or allocates more than its baseline */
+static void bench_compare(const char *s, const char *backend,
+    const struct bench_stats *st)
+{
+    struct bench_base *b = NULL;
+    if (isnan(st->median)) {
+        return;
+    }
+    for (int i = 0; i < vec_len(&baseline); i++) {
+        if (strcmp(vec_nth(&baseline, i).expr, s) == 0 &&
+            strcmp(vec_nth(&baseline, i).backend, backend) == 0) {
+            b = &vec_nth(&baseline, i);
+            break;
+        }
+    }
+    if (b == NULL) {
+        return;
+    }
+    double limit = 1 + threshold / 100;
+    if (st->median > b->ns * limit) {
+        fprintf(stderr, "REGRESSION: %s [%s]: %.2f ns/op, baseline %.2f\n",
+            s, backend, st->median, b->ns);
+        status = 1;
+    }
+    if (st->allocs > b->allocs * limit + 0.005) {
+        fprintf(stderr, "REGRESSION: %s [%s]: %.2f allocs/op, baseline %.2f\n",
+            s, backend, st->allocs, b->allocs);
+        status = 1;
+    }
+}
+
+static void bench_done(const char *s, const char *backend,
+    const struct bench_stats *st)
+{
+    bench_report(s, backend, st);
+    bench_compare(s, backend, st);
+}
+
+/* Benchmarks s, reported as name. Only evaluators that don't recurse run
+ * deep expressions, and the first of them is the reference. */
+static void bench_named(const char *name, const char *s, int deep)
+{
+    struct bench_stats parse, destroy, st;
+    const struct bench_backend *ref = &backends[0];
+    float want, got;
+    while (deep && !ref->deep) {
+        ref++;
+    }
+    if (bench_result(ref, s, &want) < 0) {
+        fprintf(stderr, "FAIL: %s can't be compiled\n", name);
         status = 1;
         return;
     }
-    long N = 1000000L;
-    for (long i = 0; i < N; i++) {
-        expr_eval(e);
-    }
-    gettimeofday(&t, NULL);
-    double end = t.tv_sec + t.tv_usec * 1e-6;
-    expr_destroy(e, &vars);
-    double ns = 1000000000 * (end - start) / N;
-    printf("BENCH %40s:\t%f ns/op (%dM op/sec)\n", s, ns, (int)(1000 / ns));
-}
-
-int main()
-{
-    test_benchmark("5");
-    test_benchmark("5+5+5+5+5+5+5+5+5+5");
-    test_benchmark("5*5*5*5*5*5*5*5*5*5");
-    test_benchmark("5,5,5,5,5,5,5,5,5,5");
-    test_benchmark("((5+5)+(5+5))+((5+5)+(5+5))+(5+5)");
-    test_benchmark("x=5");
-    test_benchmark("x=5,x+x+x+x+x+x+x+x+x+x");
-    test_benchmark("x=5,((x+x)+(x+x))+((x+x)+(x+x))+(x+x)");
-    test_benchmark("a=1,b=2,c=3,d=4,e=5,f=6,g=7,h=8,i=9,j=10");
-    test_benchmark("a=1,a=2,a=3,a=4,a=5,a=6,a=7,a=8,a=9,a=10");
-    test_benchmark("$(sqr,$1*$1),5*5");
-    test_benchmark("$(sqr,$1*$1),sqr(5)");
-    test_benchmark("x=2+3*(x/(42+next(x))),x");
-    test_benchmark("a,b,c,d,e,d,e,f,g,h,i,j,k");
-    test_benchmark("$(a,1),$(b,2),$(c,3),$(d,4),5");
+    bench_parse_cell(s, &parse, &destroy);
+    if (format == BENCH_TABLE) {
+        fprintf(out, "%-40s", name);
+    }
+    bench_done(name, "parse", &parse);
+    bench_done(name, "destroy", &destroy);
+    for (int i = 0; i < NBACKENDS; i++) {
+        /* Evaluators that can't run or disagree with expr_eval are skipped */
+        if ((deep && !backends[i].deep) ||
+            bench_result(&backends[i], s, &got) < 0 ||
+            (got != want && !(isnan(got) && isnan(want)))) {
+            st.median = st.p99 = NAN;
+        } else {
+            bench_eval_cell(&backends[i], s, &st);
+        }
+        bench_done(name, backends[i].name, &st);
+    }
+    if (format == BENCH_TABLE) {
+        fprintf(out, "\n");
+    }
+    fflush(out);
+}
+
+static void bench(const char *s)
+{
+    bench_named(s, s, 0);
+}
 
+/* Generated expressions, prefix and suffix nested n times around leaf, too
+ * deep for recursive evaluators */
+static void bench_deep(const char *name, const char *prefix, const char *leaf,
+    const char *suffix, int n)
+{
+    size_t lp = strlen(prefix), ll = strlen(leaf), ls = strlen(suffix);
+    char *s = malloc(n * (lp + ls) + ll + 1), *p = s;
+    if (s == NULL) {
+        return;
+    }
+    for (int i = 0; i < n; i++, p += lp) {
+        memcpy(p, prefix, lp);
+    }
+    memcpy(p, leaf, ll), p += ll;
+    for (int i = 0; i < n; i++, p += ls) {
+        memcpy(p, suffix, ls);
+    }
+    *p = '\0';
+    bench_named(name, s, 1);
+    free(s);
+}
+
+/* Benchmarks the expressions of a corpus file, one per line */
+static int bench_corpus(const char *path)
+{
+    char line[4096];
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0' && line[0] != '#') {
+            bench(line);
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "usage: %s [-t trials] [-m ms] [-f table|csv|json] [-o file]\n"
+        "       [-b baseline.csv] [-r percent] [-c corpus] [expression...]\n",
+        prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *output = NULL, *base = NULL, *corpus = NULL;
+    int i;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        const char *opt = argv[i];
+        if (i + 1 >= argc || opt[1] == '\0' || opt[2] != '\0') {
+            usage(argv[0]);
+        }
+        const char *arg = argv[++i];
+        switch (opt[1]) {
+        case 't':
+            trials = atoi(arg);
+            break;
+        case 'm':
+            min_trial = atof(arg) * 1e6;
+            break;
+        case 'f':
+            if (strcmp(arg, "csv") == 0) {
+                format = BENCH_CSV;
+            } else if (strcmp(arg, "json") == 0) {
+                format = BENCH_JSON;
+            } else if (strcmp(arg, "table") != 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'o':
+            output = arg;
+            break;
+        case 'b':
+            base = arg;
+            break;
+        case 'r':
+            threshold = atof(arg);
+            break;
+        case 'c':
+            corpus = arg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (trials < 1) {
+        usage(argv[0]);
+    }
+    if (base != NULL && bench_load(base) < 0) {
+        return 2;
+    }
+    out = stdout;
+    if (output != NULL && (out = fopen(output, "w")) == NULL) {
+        perror(output);
+        return 2;
+    }
+    bench_header();
+    if (corpus != NULL) {
+        if (bench_corpus(corpus) < 0) {
+            status = 2;
+        }
+    } else if (i == argc) {
+        for (size_t k = 0; k < sizeof(bench_exprs) / sizeof(*bench_exprs);
+             k++) {
+            bench(bench_exprs[k]);
+        }
+        bench_deep("x+x+... (10^5 nodes)", "", "x", "+x", 50000);
+        bench_deep("x+x+... (10^6 nodes)", "", "x", "+x", 500000);
+        bench_deep("x-(x-(...)) (10^5 nodes)", "x-(", "x", ")", 50000);
+        bench_deep("a,a,a,... (10^5 nodes)", "a,", "a", "", 50000);
+    }
+    for (; i < argc; i++) {
+        bench(argv[i]);
+    }
+    bench_footer();
+    if (out != stdout) {
+        fclose(out);
+    }
+    for (int k = 0; k < vec_len(&baseline); k++) {
+        free(vec_nth(&baseline, k).expr);
+        free(vec_nth(&baseline, k).backend);
+    }
+    vec_free(&baseline);
     return status;
 }
@@ -54,6 +54,39 @@ static void test_vars()
     assert(again == a);
     assert(again->value == 4);
     expr_destroy(NULL, &vars);
+    assert(vars.head == NULL);
+
+    /* Enough variables to grow the index several times */
+    enum { N = 20000 };
+    char name[16];
+    for (int i = 0; i < N; i++) {
+        snprintf(name, sizeof(name), "v%d", i);
+        expr_var(&vars, name, strlen(name))->value = i;
+    }
+    for (int i = 0; i < N; i++) {
+        snprintf(name, sizeof(name), "v%d", i);
+        assert(expr_var(&vars, name, strlen(name))->value == i);
+    }
+    assert(expr_var(&vars, "v1", 1)->value == 0 && vars.len == N + 1);
+    int n = 0;
+    double sum = 0;
+    for (struct expr_var *v = expr_var_next(&vars, NULL); v;
+         v = expr_var_next(&vars, v), n++) {
+        sum += v->value;
+    }
+    assert(n == N + 1 && sum == (double)N * (N - 1) / 2);
+    expr_destroy(NULL, &vars);
+
+    /* Lists filled by hand are indexed on first use */
+    struct expr_var *x = calloc(1, sizeof(struct expr_var) + 2);
+    struct expr_var *y = calloc(1, sizeof(struct expr_var) + 2);
+    strcpy(x->name, "x");
+    strcpy(y->name, "y");
+    x->next = y;
+    vars.head = x;
+    assert(expr_var(&vars, "y", 1) == y && expr_var(&vars, "x", 1) == x);
+    assert(expr_var(&vars, "z", 1) == vars.head && vars.len == 3);
+    expr_destroy(NULL, &vars);
 }
 
 /*
@@ -99,6 +132,9 @@ static void test_tokizer()
         (char *[]){ "1*11", "1", "*", "11", NULL },
         (char *[]){ "1**11", "1", "**", "11", NULL },
         (char *[]){ "1**-11", "1", "**", "-", "11", NULL },
+        (char *[]){ "1e-6-2", "1e-6", "-", "2", NULL },
+        (char *[]){ "0xe+1", "0xe", "+", "1", NULL },
+        (char *[]){ "0x1p+3*2", "0x1p+3", "*", "2", NULL },
     };
     for (unsigned int i = 0; i < sizeof(TESTS) / sizeof(TESTS[0]); i++) {
         assert_tokens(TESTS[i][0], TESTS[i] + 1);
@@ -157,13 +193,133 @@ static float user_func_print(struct expr_func *f, vec_expr_t args, void *c)
     return 0;
 }
 
+/* Native functions get the values of their arguments */
+static float user_func_sum(
+    struct expr_func *f, const float *args, int nargs, void *c)
+{
+    (void)f, (void)c;
+    float sum = 0;
+    for (int k = 0; k < nargs; k++) {
+        sum += args[k];
+    }
+    return sum;
+}
+
+static int sum_batches = 0;
+static void user_func_sum_batch(struct expr_func *f, const float *const *args,
+    int nargs, float *out, size_t n, void *c)
+{
+    __atomic_add_fetch(&sum_batches, 1, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < n; i++) {
+        float row[8];
+        for (int k = 0; k < nargs && k < 8; k++) {
+            row[k] = args[k][i];
+        }
+        out[i] = user_func_sum(f, row, nargs < 8 ? nargs : 8, c);
+    }
+}
+
+static float user_func_mix(
+    struct expr_func *f, const float *args, int nargs, void *c)
+{
+    (void)f, (void)c;
+    return nargs < 3 ? NAN : args[0] + (args[1] - args[0]) * args[2];
+}
+
 static struct expr_func user_funcs[] = {
     { "nop", user_func_nop, user_func_nop_cleanup,
         sizeof(struct nop_context) },
     { "add", user_func_add, NULL, 0 }, { "next", user_func_next, NULL, 0 },
-    { "print", user_func_print, NULL, 0 }, { NULL, NULL, NULL, 0 },
+    { "print", user_func_print, NULL, 0 },
+    { "sum", NULL, NULL, 0, user_func_sum, user_func_sum_batch },
+    { "mix", NULL, NULL, 0, user_func_mix, NULL }, { NULL, NULL, NULL, 0 },
 };
 
+static int same_result(float a, float b)
+{
+    return (isnan(a) && isnan(b)) || memcmp(&a, &b, sizeof(float)) == 0;
+}
+
+/* Evaluates s again through the compiled program, which must agree with
+ * expr_eval bit for bit */
+static void test_program(char *s, float expected)
+{
+    for (int flags = 0; flags <= EXPR_COMPILE_CSE; flags += EXPR_COMPILE_CSE) {
+        struct expr_var_list vars = { 0 };
+        struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
+        struct expr_program *p = expr_compile_ex(e, flags);
+        if (p == NULL) {
+            printf("FAIL: %s can't be compiled\n", s);
+            status = 1;
+        } else {
+            float result = expr_program_eval(p);
+            if (!same_result(result, expected)) {
+                printf("FAIL: %s: program(%d) %f != %f\n", s, flags, result,
+                    expected);
+                status = 1;
+            }
+        }
+        expr_program_destroy(p);
+        expr_destroy(e, &vars);
+    }
+    struct expr_var_list vars = { 0 };
+    struct expr *e;
+    struct expr_program *p;
+
+    /* So must frame programs, without touching the variables. Those with
+     * custom functions are not compiled. */
+    e = expr_create(s, strlen(s), &vars, user_funcs);
+    p = expr_compile_ex(e, EXPR_COMPILE_FRAME | EXPR_COMPILE_CSE);
+    if (p != NULL) {
+        float *slots = calloc(p->nslots, sizeof(float));
+        float result = expr_program_eval_frame(p, slots);
+        if (!same_result(result, expected)) {
+            printf("FAIL: %s: frame %f != %f\n", s, result, expected);
+            status = 1;
+        }
+        for (struct expr_var *v = vars.head; v; v = v->next) {
+            assert(v->value == 0);
+        }
+        free(slots);
+    }
+    expr_program_destroy(p);
+    expr_destroy(e, &vars);
+
+    /* Native code must agree as well, where the JIT is available */
+    e = expr_create(s, strlen(s), &vars, user_funcs);
+    p = expr_compile(e);
+    expr_jit_t jit = p ? expr_program_jit(p) : NULL;
+    if (jit != NULL && !same_result(jit(), expected)) {
+        printf("FAIL: %s: jit %f != %f\n", s, jit(), expected);
+        status = 1;
+    }
+    expr_program_destroy(p);
+    expr_destroy(e, &vars);
+
+    /* The iterative evaluator too */
+    e = expr_create(s, strlen(s), &vars, user_funcs);
+    if (!same_result(expr_eval_with_dfs(e), expected)) {
+        printf("FAIL: %s: dfs %f != %f\n", s, expr_eval_with_dfs(e),
+            expected);
+        status = 1;
+    }
+    expr_destroy(e, &vars);
+
+    /* And compact copies */
+    e = expr_create(s, strlen(s), &vars, user_funcs);
+    struct expr_compact *k = expr_compact(e);
+    if (k == NULL) {
+        printf("FAIL: %s can't be compacted\n", s);
+        status = 1;
+    } else if (!same_result(expr_compact_eval(k), expected)) {
+        printf("FAIL: %s: compact %f != %f\n", s, expr_compact_eval(k),
+            expected);
+        status = 1;
+    }
+    expr_compact_destroy(k);
+    expr_destroy(e, &vars);
+}
+
 static void test_expr(char *s, float expected)
 {
     struct expr_var_list vars = { 0 };
@@ -192,6 +348,8 @@ static void test_expr(char *s, float expected)
     }
     expr_destroy(e, &vars);
     free(p);
+
+    test_program(s, result);
 }
 
 static void test_expr_error(char *s)
@@ -218,6 +376,28 @@ static void test_const()
     test_expr(" 1 ", 1);
     test_expr("12", 12);
     test_expr("12.3", 12.3);
+    test_expr("1e3", 1000);
+    test_expr("2.5E-3", 0.0025);
+    test_expr("1e+2 - 1.", 99);
+    test_expr("0x1F + 0x1.8p1", 34);
+    test_expr("1e40", INFINITY);
+    test_expr("3e-50", 0);
+
+    /* Literals round correctly to the nearest float, ties to even */
+    char *exact[] = { "0.1", "3.4028235e38", "1.00000005960464477539062",
+        "1.000000059604644775390625", "1.00000017881393432617187499",
+        "123456789012345678901234567890", "1.17549435e-38", "1.4e-45",
+        "0x1.fffffep127", NULL };
+    for (char **p = exact; *p; p++) {
+        struct expr_var_list vars = { 0 };
+        struct expr *e = expr_create(*p, strlen(*p), &vars, NULL);
+        float result = expr_eval(e), expected = strtof(*p, NULL);
+        if (memcmp(&result, &expected, sizeof(float)) != 0) {
+            printf("FAIL: %s: %a != %a\n", *p, result, expected);
+            status = 1;
+        }
+        expr_destroy(e, &vars);
+    }
 }
 
 static void test_unary()
@@ -293,6 +473,12 @@ static void test_assign()
 {
     test_expr("x=5", 5);
     test_expr("x=y=3", 3);
+
+    /* The left operand is computed before the right one assigns */
+    test_expr("x=2, x ** (x=3)", 8);
+    test_expr("x=1, x % (x=3)", 1);
+    test_expr("(x=3) ** x", 27);
+    test_expr("x=2, x * (x=3) - x / (x=4) + (x < (x=5)) + (x << (x=1))", 16.25);
 }
 
 static void test_comma()
@@ -303,6 +489,9 @@ static void test_comma()
     test_expr("x=5, y = 3, x+y", 8);
     test_expr("x=5, x=(x!=0)", 1);
     test_expr("x=5, x = x+1", 6);
+    test_expr("x=0, (x=x+1) && (x=x+1), x", 2);
+    test_expr("x=0, (x=x+1) || (x=x+1), x", 1);
+    test_expr("x=1, y=0, (x&&y) || (y=x*3), x*(y-x&&x)", 1);
 }
 
 static void test_funcs()
@@ -316,6 +505,669 @@ static void test_funcs()
     test_expr("$(number, 1), $(number, 2+3), number()", 5);
     test_expr("$(triw, ($1 * 256) & 255), triw(0.5, 2)", 128);
     test_expr("$(triw, ($1 * 256) & 255), triw(0.1)+triw(0.7)+triw(0.2)", 255);
+
+    /* Arguments belong to the call, nested calls don't clobber them */
+    test_expr("$(f, $1 - $2), $(g, f($2, $1) * $1), g(2, 5)", 6);
+    test_expr("$(sq, $1*$1), $(f, $1 + sq($2) + $1), f(1, 3)", 11);
+    test_expr("$(inc, $1 = $1 + 1, $1 * 10), x = 4, inc(x) + x", 54);
+    test_expr("$1 = 7, $(f, $1), f(3) + $1", 10);
+    test_expr("$(f, $2), f(1) + f(1, 2, 3)", 2);
+    test_expr("$(h, add($1, $2)), h(h(1, 2), 3)", 6);
+    test_expr("$(f, $1 && ($1 = 5), $1), f(0) + f(1)", 5);
+
+    /* Native functions */
+    test_expr("sum()", 0);
+    test_expr("sum(1, 2, 3, 4)", 10);
+    test_expr("mix(2, 10, sum(0.25, 0.5))", 8);
+    test_expr("mix(1, 2)", NAN);
+    test_expr("x = 2, add(sum(x, 1), next(sum())) + sum(x = 3, x)", 10);
+    test_expr("$(f, sum($1, $2) * $1), f(2, 3) + f(sum(1, 1), 1)", 16);
+    test_expr("0 && sum(1) || mix(1, 3, 0.5)", 2);
+}
+
+static float user_func_answer(struct expr_func *f, vec_expr_t args, void *c)
+{
+    (void)f, (void)args, (void)c;
+    return 42;
+}
+
+static void test_builtins()
+{
+    test_expr("sqrt(16) + abs(-2) + floor(-1.5) + ceil(1.2)", 6);
+    test_expr("x = 2, exp(log(x)) + sin(0) * x + cos(0)", 3);
+    test_expr("x = 3, min(x, 2) + max(x, 4) * 10 + clamp(x * 2, 0, 5)", 47);
+    test_expr("x = 1, fma(x, 2, 3) + select(x - 1, 10, 20)", 25);
+    test_expr("x = 0, select(x = x + 1, x, -x), x", 1);
+    test_expr("sqrt = 4, sqrt(sqrt)", 2);
+
+    /* NaN operands are ignored and -0 is below +0 */
+    test_expr("x = 0/0, min(x, 2) + max(2, x)", 4);
+    test_expr("x = -0, 1/clamp(x, 0, 1)", INFINITY);
+    test_expr("x = -0, 1/min(x, 0)", -INFINITY);
+    test_expr("x = -0, 1/max(0, x)", INFINITY);
+
+    /* User functions of the same name are called instead */
+    struct expr_func funcs[] = {
+        { "min", user_func_answer, NULL, 0 }, { NULL, NULL, NULL, 0 },
+    };
+    struct expr_var_list vars = { 0 };
+    struct expr *e = expr_create("min(1, 2)", 9, &vars, funcs);
+    assert(e != NULL && expr_eval(e) == 42);
+    expr_destroy(e, &vars);
+}
+
+static void test_registry()
+{
+    struct expr_func_registry *r = expr_func_registry_create(user_funcs);
+    for (struct expr_func *f = user_funcs; f->name; f++) {
+        assert(expr_func_registry_find(r, f->name, strlen(f->name)) == f);
+    }
+    assert(expr_func_registry_find(r, "ad", 2) == NULL);
+    assert(expr_func_registry_find(r, "addx", 4) == NULL);
+    assert(expr_func_registry_find(r, "nextx", 4) == &user_funcs[2]);
+
+    char *s = "$(sq, $1*$1), add(sq(2), next(3)) + nop()";
+    struct expr_var_list vars = { 0 };
+    struct expr *e = expr_create_with(NULL, s, strlen(s), &vars, r);
+    assert(e != NULL && expr_eval(e) == 8);
+    expr_destroy(e, &vars);
+    assert(expr_create_with(NULL, "sub(1, 2)", 9, &vars, r) == NULL);
+
+    /* Without any table only built-ins are found */
+    e = expr_create("sqrt(4)", 7, &vars, NULL);
+    assert(e != NULL && expr_eval(e) == 2);
+    expr_destroy(e, NULL);
+    e = expr_create_with(NULL, "sqrt(x)", 7, &vars, NULL);
+    assert(e != NULL && expr_eval(e) == 0);
+    expr_destroy(e, NULL);
+    assert(expr_create("add(1, 2)", 9, &vars, NULL) == NULL);
+
+    /* The first of several functions with the same name wins */
+    enum { N = 300 };
+    struct expr_func funcs[N + 2];
+    char names[N][8];
+    for (int i = 0; i < N; i++) {
+        snprintf(names[i], sizeof(names[i]), "f%d", i);
+        funcs[i] = (struct expr_func){ names[i], user_func_next, NULL, 0 };
+    }
+    funcs[N] = (struct expr_func){ "f7", user_func_add, NULL, 0 };
+    funcs[N + 1] = (struct expr_func){ NULL, NULL, NULL, 0 };
+    struct expr_func_registry *big = expr_func_registry_create(funcs);
+    for (int i = 0; i < N; i++) {
+        assert(expr_func_registry_find(big, names[i], strlen(names[i]))
+            == &funcs[i]);
+    }
+    expr_func_registry_destroy(big);
+    expr_func_registry_destroy(r);
+    expr_destroy(NULL, &vars);
+    printf("OK: function registry\n");
+}
+
+static void test_fold_expr(char *s, int len)
+{
+    struct expr_var_list vars = { 0 };
+    struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
+    struct expr_program *p = expr_compile(e);
+    if (vec_len(&p->code) != len) {
+        printf("FAIL: %s: %d instructions, expected %d\n", s,
+            vec_len(&p->code), len);
+        status = 1;
+    } else {
+        printf("OK: %s folded to %d instructions\n", s, len);
+    }
+    expr_program_destroy(p);
+    expr_destroy(e, &vars);
+}
+
+static void test_fold()
+{
+    /* Constant subtrees become a single load followed by return */
+    test_fold_expr("((5+5)+(5+5))+((5+5)+(5+5))+(5+5)", 2);
+    test_fold_expr("-(2**0.5) * ^3 / (1 && 2 || 0)", 2);
+    test_fold_expr("(3%0)|0, 1/0, 1,2,3", 2);
+    test_fold_expr("x=2*3", 3);
+    test_fold_expr("x*(2+3)", 4);
+    test_fold_expr("next(2+3)", 2);
+
+    test_expr("(3/0)*0", NAN);
+    test_expr("-(3/0)|0", -INT_MAX);
+    test_expr("x=(2+3)*2, x+(1<2)", 11);
+}
+
+static void test_cse_expr(char *s, int eliminated)
+{
+    struct expr_var_list vars = { 0 };
+    struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
+    struct expr_program *p = expr_compile_ex(e, EXPR_COMPILE_CSE);
+    if (p->eliminated != eliminated) {
+        printf("FAIL: %s: %d nodes eliminated, expected %d\n", s,
+            p->eliminated, eliminated);
+        status = 1;
+    } else {
+        printf("OK: %s eliminated %d nodes\n", s, eliminated);
+    }
+    expr_program_destroy(p);
+    expr_destroy(e, &vars);
+}
+
+static void test_cse()
+{
+    test_cse_expr("x+y", 0);
+    test_cse_expr("(x+x)*(x+x)", 4);
+    test_cse_expr("x=5,((x+x)+(x+x))+((x+x)+(x+x))+(x+x)", 15);
+    test_cse_expr("x*y + y*x", 2); /* operands are not reordered */
+    test_cse_expr("x+1, x=2, x+1", 2); /* x is 2, 1 is shared */
+    test_cse_expr("x+1, next(x), x+1", 1);
+    test_cse_expr("(x+1) && (x+1) || (x+1)", 6);
+    test_cse_expr("y && (x+1), x+1", 0);
+
+    /* Ordering hazards must see the new values */
+    test_expr("x=1, x+1, x=2, x+1", 3);
+    test_expr("x=1, (x+1) + (x=2) + (x+1)", 7);
+    test_expr("x=1, a = x*2, add(x=3, 0), a + x*2", 8);
+    test_expr("x=1, y=0, (y && (x=5)), (x+1) + (y || (x=7)) + (x+1)", 17);
+    test_expr("x=1, y=0, (y || (x=5)), (x+1) + (x+1)", 12);
+}
+
+static void test_frame()
+{
+    struct expr_var_list vars = { 0 };
+    char *s = "$(lerp, $1 + ($2 - $1) * t), y = lerp(x, 2*x), y + (x && t)";
+    struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
+    struct expr_program *p = expr_compile_ex(e, EXPR_COMPILE_FRAME);
+    assert(p != NULL && p->nslots == (int)vars.len + p->nregs);
+    int x = expr_var(&vars, "x", 1)->index;
+    int t = expr_var(&vars, "t", 1)->index;
+    int y = expr_var(&vars, "y", 1)->index;
+
+    /* Frames are independent of each other and of the variables */
+    float *f1 = calloc(p->nslots, sizeof(float));
+    float *f2 = calloc(p->nslots, sizeof(float));
+    f1[x] = 4, f1[t] = 0.5;
+    f2[x] = 10, f2[t] = 0;
+    assert(expr_program_eval_frame(p, f1) == 6.5);
+    assert(expr_program_eval_frame(p, f2) == 10);
+    assert(f1[y] == 6 && f2[y] == 10);
+    assert(expr_var(&vars, "y", 1)->value == 0);
+    assert(isnan(expr_program_eval(p)));
+    assert(expr_program_jit(p) == NULL);
+    expr_program_destroy(p);
+    expr_destroy(e, &vars);
+    free(f1);
+    free(f2);
+
+    /* Registers live in the frame, however many there are */
+    struct expr_var_list many = { 0 };
+    char big[1024] = "a=1, 0";
+    for (int i = 1; i <= 100; i++) {
+        sprintf(big + strlen(big), "+a*%d", i);
+    }
+    e = expr_create(big, strlen(big), &many, user_funcs);
+    p = expr_compile_ex(e, EXPR_COMPILE_FRAME | EXPR_COMPILE_CSE);
+    assert(p != NULL && p->nregs > 64);
+    f1 = calloc(p->nslots, sizeof(float));
+    assert(expr_program_eval_frame(p, f1) == 5050);
+    expr_program_destroy(p);
+    expr_destroy(e, &many);
+    free(f1);
+
+    /* Custom functions see the shared variables, they can't be framed */
+    e = expr_create("add(x, 1)", 9, &vars, user_funcs);
+    assert(expr_compile_ex(e, EXPR_COMPILE_FRAME) == NULL);
+    expr_destroy(e, &vars);
+    printf("OK: frames\n");
+}
+
+/* Evaluates head, then prefix nested n times around leaf, without recursion.
+ * x is 2 unless head changes it. */
+static void test_deep_expr(char *head, char *prefix, char *leaf,
+    char *suffix, int n, float expected)
+{
+    size_t lh = strlen(head), lp = strlen(prefix), ll = strlen(leaf);
+    size_t ls = strlen(suffix);
+    char *s = malloc(lh + n * (lp + ls) + ll + 1), *p = s;
+    memcpy(p, head, lh), p += lh;
+    for (int i = 0; i < n; i++, p += lp) {
+        memcpy(p, prefix, lp);
+    }
+    memcpy(p, leaf, ll), p += ll;
+    for (int i = 0; i < n; i++, p += ls) {
+        memcpy(p, suffix, ls);
+    }
+    *p = '\0';
+
+    struct expr_var_list vars = { 0 };
+    expr_var(&vars, "x", 1)->value = 2;
+    struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
+    struct expr *one = expr_create("1", 1, &vars, NULL);
+    float result = (e != NULL ? expr_eval_with_dfs(e) : NAN);
+    /* Constant operands would be folded into a single node */
+    assert(e == NULL || e->type != one->type);
+    expr_destroy(one, NULL);
+    if (result != expected) {
+        printf("FAIL: %.24s... (%d levels): dfs %f != %f\n", s, n, result,
+            expected);
+        status = 1;
+    } else {
+        printf("OK: %.24s... (%d levels) == %f\n", s, n, expected);
+    }
+    expr_destroy(e, &vars);
+    free(s);
+}
+
+static void test_deep()
+{
+    test_deep_expr("", "", "x", "+1", 30000, 30002);
+    test_deep_expr("x=1, ", "", "x", "+x", 300000, 300001);
+    test_deep_expr("", "1-(", "x", ")", 30001, -1);
+    test_deep_expr("", "x=", "3", "", 30000, 3);
+    test_deep_expr("", "1&&(", "x", ")", 30000, 2);
+    test_deep_expr("", "sum(1, ", "1", ")", 30000, 30001);
+    /* Frames of calls move along with the value stack as it grows */
+    test_deep_expr("$(f, $1+1), ", "f(", "0", ")", 30000, 30000);
+    test_deep_expr("$(f, $1-$2), ", "f(1, ", "0", ")", 30001, 1);
+}
+
+static void test_rebalance_expr(char *s, int depth, float expected)
+{
+    struct expr_var_list vars = { 0 };
+    struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
+    int d = expr_rebalance(e);
+    float eval = expr_eval(e), dfs = expr_eval_with_dfs(e);
+    if (d != depth || eval != expected || dfs != expected) {
+        printf("FAIL: %s rebalanced: depth %d (%d), %f and %f != %f\n", s, d,
+            depth, eval, dfs, expected);
+        status = 1;
+    } else {
+        printf("OK: %s rebalanced to depth %d\n", s, depth);
+    }
+    expr_destroy(e, &vars);
+}
+
+static void test_rebalance()
+{
+    /* Chains are left leaning after parsing, the pass is opt-in */
+    struct expr_var_list vars = { 0 };
+    struct expr *e = expr_create("x+x+x+x", 7, &vars, NULL);
+    assert(vec_nth(&e->param.op.args, 1).type != e->type);
+    assert(expr_rebalance(e) == 2);
+    assert(vec_nth(&e->param.op.args, 1).type == e->type);
+    assert(expr_rebalance(e) == 2 && expr_eval(e) == 0);
+    expr_destroy(e, &vars);
+
+    test_rebalance_expr("x", 0, 0);
+    test_rebalance_expr("x=1, x+x+x+x+x+x+x+x+x+x+x+x+x+x+x+x", 5, 16);
+    test_rebalance_expr("x=2, x+x*x+x", 4, 8);
+    test_rebalance_expr("x=2, (x+x+x+x)*(x*x*x*x)", 5, 128);
+    test_rebalance_expr("x=1, x|(x*2)|(x*4)|(x*8)", 4, 15);
+    test_rebalance_expr("x=1, x^(x*3)^(x*2)&(x*7)&(x*6)", 6, 0);
+    test_rebalance_expr("x=1, x-x-x-x", 4, -2); /* not associative */
+    /* Intermediate results are floats, bitwise chains may change too */
+    test_rebalance_expr("x=16777216, x|1|2", 3, 16777220);
+    test_rebalance_expr("x=1, sum(x+x+x, x+x+x+x)", 4, 7);
+    test_rebalance_expr("$(f, $1+$1+$1+$1), x=1, f(x+x+x+x)", 5, 16);
+    /* Operands are still evaluated left to right */
+    test_rebalance_expr("x=1, (x=x*2)+(x=x+1)+(x=x*3)+x", 5, 23);
+
+    /* Long chains are rebuilt without recursion */
+    int n = 300000;
+    char *s = malloc(5 + 2 * n + 1);
+    strcpy(s, "x=1,x");
+    for (int i = 0; i < n; i++) {
+        strcpy(s + 5 + 2 * i, "+x");
+    }
+    e = expr_create(s, strlen(s), &vars, NULL);
+    assert(expr_rebalance(e) == 20 && expr_eval(e) == n + 1);
+    expr_destroy(e, &vars);
+    free(s);
+}
+
+static void test_simplify_expr(
+    char *s, int flags, int rewrites, float expected)
+{
+    struct expr_var_list vars = { 0 };
+    struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
+    float before = expr_eval(e);
+    int n = expr_simplify(NULL, e, flags);
+    float result = expr_eval(e), dfs = expr_eval_with_dfs(e);
+    struct expr_program *p = expr_compile(e);
+    float vm = expr_program_eval(p);
+    /* Without fast math, results don't change at all */
+    if (n != rewrites || !same_result(result, expected) ||
+        !same_result(dfs, expected) || !same_result(vm, expected) ||
+        (!flags && !same_result(before, expected))) {
+        printf("FAIL: %s simplified: %d rewrites (%d), %g %g %g != %g\n", s,
+            n, rewrites, result, dfs, vm, expected);
+        status = 1;
+    } else {
+        printf("OK: %s simplified with %d rewrites\n", s, rewrites);
+    }
+    expr_program_destroy(p);
+    expr_destroy(e, &vars);
+}
+
+static void test_simplify()
+{
+    int fast = EXPR_SIMPLIFY_FAST_MATH;
+    test_simplify_expr("x=3, x*1 + 1*x + x/1", 0, 3, 9);
+    test_simplify_expr("x=3, -(-x) + -(-(-(-x)))", 0, 3, 6);
+    test_simplify_expr("x=3, !!(x<4) + !!!!(x>4)", 0, 3, 1);
+    test_simplify_expr("x=3, !!x", 0, 0, 1);
+    test_simplify_expr("x=3, (x-0) + ((x<4)+0) + (0+(x|1))", 0, 3, 7);
+    test_simplify_expr("x=-0, x+0", 0, 0, 0);
+    test_simplify_expr("x=-0, x-0", 0, 1, -0.0f);
+    test_simplify_expr("x=3, x/4 + x/0.5", 0, 2, 6.75);
+    test_simplify_expr("x=3, x/3", 0, 0, 1);
+    test_simplify_expr("x=3, x**2 + x**1 + x**-1", 0, 1,
+        powf(3, 2) + 3 + powf(3, -1));
+    test_simplify_expr("x=0/0, x**0", 0, 1, 1);
+    test_simplify_expr("x=3, (x+1)**2 + (x=2)**0 + x**0.5 + x**3", 0, 0,
+        16 + 1 + powf(2, 0.5) + 8);
+    /* Rewrites uncover others */
+    test_simplify_expr("x=3, ((x*1)**2/1)**1", 0, 3, powf(3, 2));
+
+    /* powf() differs from x*x and 1/x for some inputs, by an ulp or so */
+    char *pows[] = { "x**2", "x**-1" };
+    float xs[] = { 0x1.8p-74f, 0x1.0080ap-128f };
+    for (int i = 0; i < 2; i++) {
+        struct expr_var_list vars = { 0 };
+        struct expr *e = expr_create(pows[i], strlen(pows[i]), &vars, NULL);
+        expr_var(&vars, "x", 1)->value = xs[i];
+        float before = expr_eval(e);
+        assert(expr_simplify(NULL, e, 0) == 0);
+        assert(same_result(expr_eval(e), before));
+        expr_destroy(e, &vars);
+    }
+
+    test_simplify_expr("x=-0, x+0", fast, 1, -0.0f);
+    test_simplify_expr("x=3, x/3", fast, 1, 3 * (1 / 3.0f));
+    test_simplify_expr("x=2, x**0.5", fast, 1, sqrtf(2));
+    test_simplify_expr("x=3, x**2 + x**-1", fast, 2, 9 + 1 / 3.0f);
+    test_simplify_expr("x=3, x**5 + x**-3", fast, 2, 243 + 1 / 27.0f);
+    test_simplify_expr("x=3, x**17", fast, 0, powf(3, 17));
+
+    /* Expressions in arenas take new nodes from there */
+    struct expr_var_list vars = { 0 };
+    struct expr_arena *arena = expr_arena_create(64);
+    char *s = "x=2, x**16 * 1";
+    struct expr *e = expr_create_in(arena, s, strlen(s), &vars, NULL);
+    assert(expr_simplify(arena, e, fast) == 2 && expr_eval(e) == 65536);
+    expr_arena_destroy(arena);
+    expr_destroy(NULL, &vars);
+}
+
+static void test_compact()
+{
+    struct expr_var_list vars = { 0 };
+    char *s = "$(sq, $1*$1), x = sq(x+1) + sq(2), x * (x > 10) + sq(x)";
+    struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
+    struct expr_compact *k = expr_compact(e);
+    assert(sizeof(struct expr_node) == 16);
+    assert(k != NULL && k->nodes[k->len - 1].type == e->type);
+    assert(k->size < k->len * sizeof(struct expr));
+
+    /* Without custom functions the source tree is no longer needed */
+    expr_destroy(e, NULL);
+    expr_var(&vars, "x", 1)->value = 2;
+    assert(expr_compact_eval(k) == 13 + 169);
+    assert(expr_var(&vars, "x", 1)->value == 13);
+    expr_compact_destroy(k);
+    expr_destroy(NULL, &vars);
+
+    /* The left operand is computed first, like in programs */
+    char *order[] = { "x=2, x ** (x=3)", "x=1, x % (x=3)", "(x=3) ** x" };
+    for (int i = 0; i < 3; i++) {
+        e = expr_create(order[i], strlen(order[i]), &vars, NULL);
+        k = expr_compact(e);
+        struct expr_program *p = expr_compile(e);
+        assert(same_result(expr_compact_eval(k), expr_program_eval(p)));
+        expr_program_destroy(p);
+        expr_compact_destroy(k);
+        expr_destroy(e, &vars);
+    }
+    printf("OK: compact expressions\n");
+}
+
+/*
+ * ARENA TESTS
+ */
+static int arena_cleanups = 0;
+static void user_func_count_cleanup(struct expr_func *f, void *c)
+{
+    (void)f, (void)c;
+    arena_cleanups++;
+}
+
+static void test_arena_expr(struct expr_arena *arena,
+    struct expr_var_list *vars, struct expr_func *funcs, char *s,
+    float expected)
+{
+    struct expr *e = expr_create_in(arena, s, strlen(s), vars, funcs);
+    if (e == NULL) {
+        printf("FAIL: %s can't be compiled in an arena\n", s);
+        status = 1;
+        return;
+    }
+    float result = expr_eval(e);
+    if (!same_result(result, expected)) {
+        printf("FAIL: %s: %f != %f\n", s, result, expected);
+        status = 1;
+    } else {
+        printf("OK: %s == %f\n", s, expected);
+    }
+}
+
+static void test_arena()
+{
+    struct expr_func funcs[] = {
+        { "nop", user_func_nop, user_func_nop_cleanup,
+            sizeof(struct nop_context) },
+        { "count", user_func_next, user_func_count_cleanup, sizeof(int) },
+        { "add", user_func_add, NULL, 0 }, { NULL, NULL, NULL, 0 },
+    };
+    struct expr_var_list vars = { 0 };
+    /* A tiny block size makes every expression span several blocks */
+    struct expr_arena *arena = expr_arena_create(64);
+    for (int round = 0; round < 3; round++) {
+        arena_cleanups = 0;
+        test_arena_expr(arena, &vars, funcs, "2+3*4", 14);
+        test_arena_expr(arena, &vars, funcs, "x=5, (x+1)*(x-1) - -x", 29);
+        test_arena_expr(arena, &vars, funcs, "add(nop(), count(1)+count(2))", 5);
+        test_arena_expr(arena, &vars, funcs,
+            "$(sq, $1*$1), $(hyp, sq($1)+sq($2)), hyp(3, add(2, 2))", 25);
+        test_arena_expr(arena, &vars, funcs, "1 && count(0) || 3", 1);
+        assert(expr_create_in(arena, "add(1, (2", 9, &vars, funcs) == NULL);
+        assert(expr_create_in(arena, "count(2)+", 9, &vars, funcs) == NULL);
+        expr_arena_reset(arena);
+        /* Contexts of failed expressions are released too */
+        assert(arena_cleanups == 4);
+    }
+    expr_arena_destroy(arena);
+    expr_destroy(NULL, &vars);
+}
+
+/*
+ * CACHE TESTS
+ */
+static struct expr *cache_get(struct expr_cache *c, char *s,
+    struct expr_var_list *vars)
+{
+    return expr_cache_get(c, s, strlen(s), vars, user_funcs);
+}
+
+static void test_cache()
+{
+    struct expr_var_list vars = { 0 }, other = { 0 };
+    struct expr_cache_stats st;
+
+    /* Measure one entry, texts of the same shape take the same room */
+    struct expr_cache *c = expr_cache_create(1 << 20);
+    expr_cache_release(c, cache_get(c, "x+1", &vars));
+    expr_cache_get_stats(c, &st);
+    size_t entry = st.bytes;
+    assert(st.misses == 1 && st.entries == 1 && entry > 0);
+    expr_cache_destroy(c);
+
+    c = expr_cache_create(2 * entry);
+    struct expr *a = cache_get(c, "x+1", &vars);
+    assert(cache_get(c, "x+1", &vars) == a);
+    /* Same text with another variable list is a different entry */
+    struct expr *o = cache_get(c, "x+1", &other);
+    assert(o != a);
+    expr_var(&other, "x", 1)->value = 9;
+    assert(expr_eval(o) == 10 && expr_eval(a) == 1);
+    expr_cache_release(c, o);
+    assert(cache_get(c, "x+", &vars) == NULL);
+    expr_var(&vars, "x", 1)->value = 4;
+    assert(expr_eval(a) == 5);
+    expr_cache_get_stats(c, &st);
+    assert(st.hits == 1 && st.misses == 3 && st.entries == 2);
+
+    /* Going over budget evicts released entries, oldest first */
+    struct expr *b = cache_get(c, "x+2", &vars);
+    expr_cache_get_stats(c, &st);
+    assert(st.entries == 2 && st.evictions == 1 && st.bytes == 2 * entry);
+
+    /* Entries in use are kept, even over budget */
+    struct expr *d = cache_get(c, "x+3", &vars);
+    expr_cache_get_stats(c, &st);
+    assert(st.entries == 3 && st.evictions == 1 && st.bytes == 3 * entry);
+    expr_cache_release(c, b);
+    expr_cache_get_stats(c, &st);
+    assert(st.entries == 2 && st.evictions == 2);
+    assert(expr_eval(d) == 7);
+    expr_cache_release(c, d);
+    expr_cache_release(c, a);
+    expr_cache_release(c, a);
+    assert(cache_get(c, "x+1", &vars) == a);
+    expr_cache_release(c, a);
+    expr_cache_get_stats(c, &st);
+    assert(st.hits == 2 && st.misses == 5 && st.evictions == 2);
+
+    expr_cache_destroy(c);
+    expr_destroy(NULL, &vars);
+    expr_destroy(NULL, &other);
+    printf("OK: expression cache\n");
+}
+
+/*
+ * BATCH TESTS
+ */
+static struct expr_pool *test_pool;
+
+static void test_batch_expr(char *s)
+{
+    enum { N = 300 };
+    float xs[N], ys[2 * N], out[N], par[N];
+    for (int i = 0; i < N; i++) {
+        xs[i] = (i % 7) - 3 + (i % 3) * 0.25f;
+        ys[2 * i] = (i % 5) - 2;
+        ys[2 * i + 1] = NAN; /* never read, rows are 2 floats apart */
+    }
+    xs[5] = NAN;
+    xs[6] = INFINITY;
+    xs[7] = -INFINITY;
+    xs[8] = 3e9;
+    xs[9] = -3e9;
+    xs[10] = -0.0f;
+    ys[22] = 40;
+    ys[24] = -33;
+
+    struct expr_var_list vars = { 0 };
+    struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
+    struct expr_column cols[] = {
+        { expr_var(&vars, "x", 1), xs, 1 },
+        { expr_var(&vars, "y", 1), ys, 2 },
+    };
+    int ok = (expr_eval_batch(e, cols, 2, out, N) == 0);
+    float last = expr_var(&vars, "t", 1)->value;
+    expr_destroy(e, &vars);
+
+    /* Chunks of 50 rows end in the middle of blocks */
+    e = expr_create(s, strlen(s), &vars, user_funcs);
+    cols[0].var = expr_var(&vars, "x", 1);
+    cols[1].var = expr_var(&vars, "y", 1);
+    ok = ok && (expr_eval_parallel(test_pool, e, cols, 2, par, N, 50) == 0);
+    if (memcmp(out, par, sizeof(out)) != 0
+        || !same_result(last, expr_var(&vars, "t", 1)->value)) {
+        printf("FAIL: %s: parallel and batch results differ\n", s);
+        ok = 0;
+    }
+    expr_destroy(e, &vars);
+
+    struct expr_var_list rowvars = { 0 };
+    e = expr_create(s, strlen(s), &rowvars, user_funcs);
+    struct expr_var *x = expr_var(&rowvars, "x", 1);
+    struct expr_var *y = expr_var(&rowvars, "y", 1);
+    for (int i = 0; i < N; i++) {
+        x->value = xs[i];
+        y->value = ys[2 * i];
+        float expected = expr_eval(e);
+        if (!same_result(out[i], expected)) {
+            printf("FAIL: %s: row %d: %f != %f\n", s, i, out[i], expected);
+            ok = 0;
+            break;
+        }
+    }
+    if (!same_result(last, expr_var(&rowvars, "t", 1)->value)) {
+        printf("FAIL: %s: t is %f after batch\n", s, last);
+        ok = 0;
+    }
+    if (ok) {
+        printf("OK: batch %s\n", s);
+    } else {
+        status = 1;
+    }
+    expr_destroy(e, &rowvars);
+}
+
+static void test_batch()
+{
+    test_pool = expr_pool_create(4);
+    assert(expr_pool_size(test_pool) >= 1); /* 1 without threads */
+    test_batch_expr("x+y*2");
+    test_batch_expr("x/y - x%y + x**2");
+    test_batch_expr("(x<y) + (x<=y)*2 + (x>y)*4 + (x>=y)*8 + (x==y) + (x!=y)");
+    test_batch_expr("(x&y) + (x|y) + (x^y) + (x<<2) + (y>>1) + ^x + !x + -y");
+    test_batch_expr("x && y");
+    test_batch_expr("x || y");
+    test_batch_expr("(x && y) || (x-1 && (y || 7)) || 0");
+    test_batch_expr("t = x*y, t = t+1, t*t");
+    test_batch_expr("x = x+1, y = x*2, x+y");
+    test_batch_expr("t = t+x");                    /* carries over rows */
+    test_batch_expr("x && (t = y)");               /* conditional assign */
+    test_batch_expr("t = x, t ** (t = y) + t % (t = x) + (t = y) ** t");
+    test_batch_expr("$(f, $1*$2 - $1), f(x, y) + f(y, x)");
+    test_batch_expr("$(f, $1 && ($1 = y), $1), f(x)");
+    test_batch_expr("t = next(x), add(t, y)");     /* user functions */
+    test_batch_expr("mix(x, y, 0.25) + sum(x, y, 1)");
+    test_batch_expr("x && sum(y, t = y)");
+    test_batch_expr("min(x, y) + max(y, x) * 2 + clamp(x, -1, y)");
+    test_batch_expr("1/min(x, -y) + 1/max(-x, y)");
+    test_batch_expr("sqrt(abs(x)) + floor(x) - ceil(y / 3)");
+    test_batch_expr("fma(x, y, 0.1) + select(x - y, x, y)");
+    test_batch_expr("exp(y) + log(abs(x)) + sin(x) * cos(y)");
+    assert(sum_batches > 0);
+
+    /* Many chunks, more than one per worker */
+    enum { N = 100003 };
+    float *xs = malloc(N * sizeof(float)), *out = malloc(N * sizeof(float));
+    struct expr_var_list vars = { 0 };
+    struct expr *e = expr_create("t = x*x, t - 1", 14, &vars, user_funcs);
+    struct expr_column col = { expr_var(&vars, "x", 1), xs, 1 };
+    for (int i = 0; i < N; i++) {
+        xs[i] = i;
+        out[i] = NAN;
+    }
+    assert(expr_eval_parallel(test_pool, e, &col, 1, out, N, 1000) == 0);
+    for (int i = 0; i < N; i++) {
+        assert(out[i] == (float)i * (float)i - 1);
+    }
+    assert(expr_var(&vars, "t", 1)->value == (float)(N - 1) * (N - 1));
+    expr_destroy(e, &vars);
+    free(xs);
+    free(out);
+    expr_pool_destroy(test_pool);
 }
 
 static void test_name_collision()
@@ -370,6 +1222,12 @@ static void test_bad_syntax()
     test_expr_error("+(");
     test_expr_error("2=3");
     test_expr_error("2.3.4");
+    test_expr_error("1e");
+    test_expr_error("1e+");
+    test_expr_error("1.5e3.0");
+    test_expr_error("0x");
+    test_expr_error("0x1p");
+    test_expr_error("2ex");
     test_expr_error("1()");
     test_expr_error("x()");
     test_expr_error(",");
@@ -384,6 +1242,10 @@ static void test_bad_syntax()
     test_expr_error("$($())");
     test_expr_error("$(1)");
     test_expr_error("$()");
+    test_expr_error("sqrt()");
+    test_expr_error("min(1)");
+    test_expr_error("fma(1, 2, 3, 4)");
+    test_expr_error("abs(x, )");
 }
 
 int main()
@@ -402,6 +1264,19 @@ int main()
     test_assign();
     test_comma();
     test_funcs();
+    test_builtins();
+    test_registry();
+    test_fold();
+    test_cse();
+    test_frame();
+    test_compact();
+    test_deep();
+    test_rebalance();
+    test_simplify();
+    test_arena();
+    test_cache();
+
+    test_batch();
 
     test_name_collision();
     test_fancy_variable_names();